@@ -39,7 +39,8 @@ int main()
 
 		if (c.IsConnected())
 		{
-			if (!c.Incoming().IsEmpty())
+			// Sleeps until a message arrives, but wakes up often enough to keep reading the keys
+			if (c.Incoming().WaitFor(std::chrono::milliseconds(10)))
 			{
 				auto msg = c.Incoming().PopFront().msg;
 				switch (msg.header.id)
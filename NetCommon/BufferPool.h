@@ -0,0 +1,186 @@
+#pragma once
+#include "Utilities.h"
+
+/*Recycles the memory of message bodies. Requests are rounded up to size classes (powers
+of two from 64 B to 64 KB), and freed blocks are kept in a per-thread cache, so most
+allocations and frees don't touch the heap or any lock at all. When a thread's cache gets
+full, half of it is handed to a shared list, where the threads which mostly allocate (the
+I/O threads parsing messages) pick them up again. Anything bigger than the largest size
+class goes straight to the heap*/
+class BufferPool
+{
+public:
+	static constexpr size_t minBlockSize = 64;
+	static constexpr size_t numOfSizeClasses = 11;
+	static constexpr size_t maxBlockSize = minBlockSize << (numOfSizeClasses - 1);
+
+	static void* Allocate(size_t size)
+	{
+		if (size > maxBlockSize)
+			return ::operator new(size);
+
+		size_t sizeClass = SizeClass(size);
+		LocalCache& cache = Local();
+		if (!cache.blocks[sizeClass])
+			RefillLocal(cache, sizeClass);
+
+		FreeBlock* block = cache.blocks[sizeClass];
+		if (!block)
+			return ::operator new(minBlockSize << sizeClass);
+
+		cache.blocks[sizeClass] = block->next;
+		cache.counts[sizeClass]--;
+		return block;
+	}
+
+	static void Deallocate(void* p, size_t size)
+	{
+		if (size > maxBlockSize)
+		{
+			::operator delete(p);
+			return;
+		}
+
+		size_t sizeClass = SizeClass(size);
+		LocalCache& cache = Local();
+		size_t maxBlocks = MaxLocalBlocks(sizeClass);
+		if (cache.counts[sizeClass] >= maxBlocks)
+			FlushLocal(cache, sizeClass, maxBlocks / 2);
+
+		FreeBlock* block = static_cast<FreeBlock*>(p);
+		block->next = cache.blocks[sizeClass];
+		cache.blocks[sizeClass] = block;
+		cache.counts[sizeClass]++;
+	}
+
+private:
+	/*A local cache keeps at most this many blocks of a class, and at most this many bytes of
+	it - memory a thread's cache holds is never given back while the thread lives, so it has to
+	stay small for the large classes*/
+	static constexpr size_t maxLocalBlocks = 64;
+	static constexpr size_t maxLocalBytes = 128 * 1024;
+	static_assert(maxLocalBytes / maxBlockSize >= 2, "Flushing half of a local cache has to move something");
+
+	/*A shared list keeps at most this many blocks, and at most this many bytes - so the large
+	classes don't hold hundreds of megabytes after a burst*/
+	static constexpr size_t maxSharedBlocks = 4096;
+	static constexpr size_t maxSharedBytes = 4 * 1024 * 1024;
+
+	struct FreeBlock
+	{
+		FreeBlock* next;
+	};
+
+	struct LocalCache
+	{
+		FreeBlock* blocks[numOfSizeClasses] = {};
+		size_t counts[numOfSizeClasses] = {};
+
+		// Blocks of a finished thread aren't lost, other threads can still use them
+		~LocalCache()
+		{
+			for (size_t i = 0; i < numOfSizeClasses; i++)
+				FlushLocal(*this, i, this->counts[i]);
+		}
+	};
+
+	struct SharedList
+	{
+		std::mutex mutex;
+		FreeBlock* blocks = nullptr;
+		size_t count = 0;
+	};
+
+	static size_t SizeClass(size_t size)
+	{
+		size_t sizeClass = 0;
+		while ((minBlockSize << sizeClass) < size)
+			sizeClass++;
+
+		return sizeClass;
+	}
+
+	static size_t MaxLocalBlocks(size_t sizeClass)
+	{
+		return std::min(maxLocalBlocks, maxLocalBytes / (minBlockSize << sizeClass));
+	}
+
+	static LocalCache& Local()
+	{
+		thread_local LocalCache cache;
+		return cache;
+	}
+
+	static SharedList& Shared(size_t sizeClass)
+	{
+		static SharedList lists[numOfSizeClasses];
+		return lists[sizeClass];
+	}
+
+	// Takes up to half of a local cache's worth of blocks from the shared list
+	static void RefillLocal(LocalCache& cache, size_t sizeClass)
+	{
+		SharedList& shared = Shared(sizeClass);
+		std::scoped_lock lock(shared.mutex);
+		for (size_t i = 0; i < MaxLocalBlocks(sizeClass) / 2 && shared.blocks; i++)
+		{
+			FreeBlock* block = shared.blocks;
+			shared.blocks = block->next;
+			shared.count--;
+
+			block->next = cache.blocks[sizeClass];
+			cache.blocks[sizeClass] = block;
+			cache.counts[sizeClass]++;
+		}
+	}
+
+	// Moves 'count' blocks to the shared list, or back to the heap once that one is full too
+	static void FlushLocal(LocalCache& cache, size_t sizeClass, size_t count)
+	{
+		size_t maxBlocks = std::min(maxSharedBlocks, maxSharedBytes / (minBlockSize << sizeClass));
+
+		SharedList& shared = Shared(sizeClass);
+		std::scoped_lock lock(shared.mutex);
+		for (size_t i = 0; i < count; i++)
+		{
+			FreeBlock* block = cache.blocks[sizeClass];
+			cache.blocks[sizeClass] = block->next;
+			cache.counts[sizeClass]--;
+
+			if (shared.count >= maxBlocks)
+			{
+				::operator delete(block);
+				continue;
+			}
+
+			block->next = shared.blocks;
+			shared.blocks = block;
+			shared.count++;
+		}
+	}
+};
+
+// Standard allocator interface over BufferPool, so containers can draw from it
+template<typename T>
+struct PoolAllocator
+{
+	using value_type = T;
+
+	PoolAllocator() = default;
+
+	template<typename U>
+	PoolAllocator(const PoolAllocator<U>&) {}
+
+	T* allocate(size_t n)
+	{
+		return static_cast<T*>(BufferPool::Allocate(n * sizeof(T)));
+	}
+
+	void deallocate(T* p, size_t n)
+	{
+		BufferPool::Deallocate(p, n * sizeof(T));
+	}
+
+	template<typename U>
+	bool operator==(const PoolAllocator<U>&) const { return true; }
+};
@@ -1,11 +1,13 @@
 #pragma once
 #include "Connection.h"
+#include "ContextPool.h"
 
 template<typename T>
 class ClientInterface
 {
 public:
-	ClientInterface() : socket(context)
+	// Single connection rarely needs more than one thread, but the pool size can be raised
+	ClientInterface(size_t numOfThreads = 1) : contexts(numOfThreads), socket(contexts.At(0))
 	{
 
 	}
@@ -15,25 +17,27 @@ public:
 		this->Disconnect();
 	}
 
-	bool Connect(const std::string& host, const uint16_t port)
+	// 'options' are wire options asked from the server, see WireOptions
+	bool Connect(const std::string& host, const uint16_t port, const WireOptions& options = {})
 	{
 		using namespace asio::ip;
 
 		try
 		{
+			asio::io_context& connectionContext = this->contexts.Next();
 			this->conn = std::make_unique<Connection<T>>(
 				Connection<T>::Owner::CLIENT,
-				this->context,
-				tcp::socket(this->context),
+				connectionContext,
+				tcp::socket(connectionContext),
 				this->messagesIn
 			);
 
-			tcp::resolver resolver(context);
+			tcp::resolver resolver(connectionContext);
 			tcp::resolver::results_type endpoints = resolver.resolve(host, std::to_string(port));
 
-			this->conn->ConnectToServer(endpoints);
+			this->conn->ConnectToServer(endpoints, options);
 
-			this->contextThread = std::thread([this]() { this->context.run(); });
+			this->contexts.Run();
 		}
 		catch (const std::exception& ex)
 		{
@@ -49,8 +53,7 @@ public:
 		if (this->conn->IsConnected())
 			this->conn->Disconnect();
 
-		this->context.stop();
-		this->contextThread.join();
+		this->contexts.Stop();
 		this->conn.release();
 	}
 
@@ -62,11 +65,10 @@ public:
 		return this->conn->IsConnected();
 	}
 
-	TSQueue<OwnedMessage<T>>& Incoming() { return this->messagesIn; }
+	IncomingQueue<T>& Incoming() { return this->messagesIn; }
 
 protected:
-	asio::io_context context;
-	std::thread contextThread;
+	ContextPool contexts;
 	asio::ip::tcp::socket socket;
 
 	// Client has only one instance of the 'connection' object, which handles the data transfer
@@ -74,5 +76,5 @@ protected:
 
 private:
 	// Thread safe queue of incoming messages from server
-	TSQueue<OwnedMessage<T>> messagesIn;
+	IncomingQueue<T> messagesIn;
 };
\ No newline at end of file
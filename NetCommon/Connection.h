@@ -1,10 +1,62 @@
 #pragma once
 #include "Utilities.h"
 #include "Message.h"
+#include "MessageReader.h"
+#include "MessageSchema.h"
+#include "MessageBatch.h"
+#include "MemoryBudget.h"
 #include "ThreadSafeQueue.h"
+#include "MPSCQueue.h"
+#include "SPSCRing.h"
+#include "WireFormat.h"
 
+/*Queue which every connection pushes its received messages into. Defining NET_LOCKFREE_INBOUND
+replaces the mutex protected queue with the lock-free one, which scales better once
+many I/O threads push into it at the same time*/
+#ifdef NET_LOCKFREE_INBOUND
 template<typename T>
-class Connection : std::enable_shared_from_this<Connection<T>>
+using IncomingQueue = MPSCQueue<OwnedMessage<T>>;
+#else
+template<typename T>
+using IncomingQueue = TSQueue<OwnedMessage<T>>;
+#endif
+
+// What a connection does with a message sent while its outgoing queue is over the high watermark
+enum class BackpressurePolicy
+{
+	DROP_NEWEST, // The new message isn't queued, SendMsg returns false
+	DROP_OLDEST, // The new message is queued and the oldest waiting one is dropped instead
+	BLOCK, // SendMsg waits until the queue gets below the high watermark, except on an I/O thread
+	DISCONNECT // The remote side can't keep up, so it's disconnected
+};
+
+/*Watermarks of the outgoing queue. It's over the high watermark once it holds 'highBytes'
+or 'highMessages', and drained again when it's down to both 'lowBytes' and 'lowMessages'*/
+struct BackpressureOptions
+{
+	size_t highBytes = std::numeric_limits<size_t>::max();
+	size_t highMessages = std::numeric_limits<size_t>::max();
+	size_t lowBytes = 0;
+	size_t lowMessages = 0;
+	BackpressurePolicy policy = BackpressurePolicy::DROP_NEWEST;
+};
+
+// Why a connection was closed, only the first reason is remembered
+enum class DisconnectReason
+{
+	NONE, // Still connected, or never was
+	LOCAL, // Disconnect was called
+	REMOTE, // The remote side closed the connection or reading from it failed
+	WRITE_FAILED,
+	INVALID_FRAME, // The remote side sent something malformed or corrupted
+	MEMORY_BUDGET, // The remote side sent a frame which doesn't fit into the memory budget
+	QUEUE_OVERFLOW, // Outgoing queue reached the high watermark with BackpressurePolicy::DISCONNECT
+	WRITE_TIMEOUT, // A single write didn't complete before its deadline
+	TOO_SLOW // The remote side took data slower than the minimum rate
+};
+
+template<typename T>
+class Connection : public std::enable_shared_from_this<Connection<T>>
 {
 public:
 	enum class Owner
@@ -13,8 +65,10 @@ public:
 		CLIENT
 	};
 
-	Connection(Owner p, asio::io_context& c, asio::ip::tcp::socket s, TSQueue<OwnedMessage<T>>& tsq)
-		: context(c), owner(p), socket(std::move(s)), messagesIn(tsq)
+	/*'outgoingCapacity' is the number of messages which can wait to be sent, it's rounded up
+	to a power of two*/
+	Connection(Owner p, asio::io_context& c, asio::ip::tcp::socket s, IncomingQueue<T>& tsq, size_t outgoingCapacity = 4096)
+		: socket(std::move(s)), context(c), messagesOut(outgoingCapacity), writeTimer(c), rateTimer(c), messagesIn(tsq), owner(p)
 	{}
 	
 	virtual ~Connection() {}
@@ -30,17 +84,19 @@ public:
 			return;
 
 		this->id = id;
-		this->ReadHeader();
+		this->ReadMessages();
 	}
 
-	void ConnectToServer(const asio::ip::tcp::resolver::results_type& endpoints)
+	/*'options' are asked from the server right after connecting. Until the server accepts
+	them, and for anything it doesn't accept, the raw format is used*/
+	void ConnectToServer(const asio::ip::tcp::resolver::results_type& endpoints, WireOptions options = {})
 	{
 		// Only clients can connect to servers
 		if (this->owner != Owner::CLIENT)
 			return;
 
 		asio::async_connect(this->socket, endpoints,
-			[this](asio::error_code ec, asio::ip::tcp::endpoint endpoint)
+			[this, options](asio::error_code ec, asio::ip::tcp::endpoint endpoint)
 			{
 				if (ec)
 				{
@@ -48,173 +104,1021 @@ public:
 					return;
 				}
 
-				this->ReadHeader();
+				this->ReadMessages();
+
+				if (options != WireOptions())
+					this->SendControl(ControlType::NEGOTIATE_REQUEST, options.ToBits());
 			}
 		);
 	}
 
-	void Disconnect()
+	// Wire options a server side connection accepts when the client asks for them
+	void SetAllowedWireOptions(const WireOptions& options)
+	{
+		this->allowedOptions = options;
+	}
+
+	void Disconnect(DisconnectReason reason = DisconnectReason::LOCAL)
 	{
 		if (!this->IsConnected())
 			return;
 
-		asio::post(this->context, [this]() { socket.close(); });
+		asio::post(this->context, [this, reason]() { Close(reason); });
 	}
 
 	bool IsConnected() const { return this->socket.is_open(); }
 
-	void SendMsg(const Message<T>& msg)
+	DisconnectReason GetDisconnectReason() const { return this->disconnectReason.load(); }
+
+	/*Evicts a remote side which doesn't take the data sent to it. A single write which doesn't
+	complete within 'writeTimeout' closes the connection, and so does writing slower than
+	'minBytesPerSecond' on average over 'rateWindow' - counted only while there's something
+	to write, an idle connection is never too slow. Zero turns each check off.
+	Set it before sending anything*/
+	void SetWriteDeadlines(std::chrono::milliseconds writeTimeout, size_t minBytesPerSecond = 0,
+		std::chrono::milliseconds rateWindow = std::chrono::seconds(10))
+	{
+		this->writeTimeout = writeTimeout;
+		this->minBytesPerSecond = minBytesPerSecond;
+		this->rateWindow = rateWindow;
+	}
+
+	bool SendMsg(const Message<T>& msg)
+	{
+		return this->SendMsg(SharedMessage<T>(msg));
+	}
+
+	/*Queues the already serialized message, which can be shared with other connections.
+	Can be called from any thread, messages sent from one thread go out in the order they
+	were sent. Nothing is dropped unless the backpressure policy says so (see
+	SetBackpressure), false is returned then*/
+	bool SendMsg(const SharedMessage<T>& msg)
+	{
+		if (msg.BodySize() > FrameCodec<T>::maxBodySize)
+			return false;
+
+		bool dropOldest = false;
+		if (!this->ApplyBackpressure(dropOldest))
+			return false;
+
+		{
+			std::scoped_lock lock(this->sendMutex);
+			this->Push(OutgoingMessage{ msg, nullptr }, msg.Size(), dropOldest);
+		}
+
+		this->WakeWriter();
+		return true;
+	}
+
+	bool SendMsg(const Message<T>& msg, uint64_t coalesceKey)
+	{
+		return this->SendMsg(SharedMessage<T>(msg), coalesceKey);
+	}
+
+	/*Latest value wins - if a message sent with the same key is still waiting in the queue,
+	this one replaces it (and goes out in its place), otherwise it's queued as usual. Meant
+	for state updates where only the newest one matters, so a slow remote side gets fewer
+	messages instead of a growing backlog of stale ones. Same threading rules as SendMsg*/
+	bool SendMsg(const SharedMessage<T>& msg, uint64_t coalesceKey)
+	{
+		if (msg.BodySize() > FrameCodec<T>::maxBodySize)
+			return false;
+
+		// Replacing doesn't make the queue any longer, so the backpressure policy isn't applied
+		{
+			std::scoped_lock lock(this->sendMutex);
+			if (this->ReplaceQueued(msg, coalesceKey))
+				return true;
+		}
+
+		bool dropOldest = false;
+		if (!this->ApplyBackpressure(dropOldest))
+			return false;
+
+		{
+			std::scoped_lock lock(this->sendMutex);
+
+			// Another thread may have queued one with the same key in the meantime
+			if (this->ReplaceQueued(msg, coalesceKey))
+				return true;
+
+			std::shared_ptr<CoalescingSlot> slot = std::make_shared<CoalescingSlot>(CoalescingSlot{ msg, coalesceKey });
+			this->coalescingSlots.emplace(coalesceKey, slot);
+			this->Push(OutgoingMessage{ SharedMessage<T>(), std::move(slot) }, msg.Size(), dropOldest);
+		}
+
+		this->WakeWriter();
+		return true;
+	}
+
+	using BackpressureHandler = std::function<void(std::shared_ptr<Connection<T>>)>;
+
+	/*'onBackpressure' is called on the sending thread when the outgoing queue reaches the high
+	watermark, 'onDrained' on the I/O thread once it's back down to the low one. Set it
+	before sending anything. BLOCK only waits on threads which don't run an io_context - on
+	an I/O thread the message is queued over the high watermark instead*/
+	void SetBackpressure(const BackpressureOptions& options,
+		BackpressureHandler onBackpressure = nullptr, BackpressureHandler onDrained = nullptr)
 	{
-		asio::post(this->context,
-			[this, msg]()
+		this->backpressure = options;
+		this->onBackpressure = std::move(onBackpressure);
+		this->onDrained = std::move(onDrained);
+	}
+
+	bool IsBackpressured() const { return this->isBackpressured.load(); }
+
+	using CloseHandler = std::function<void(std::shared_ptr<Connection<T>>, DisconnectReason)>;
+
+	/*'handler' is called on the connection's I/O thread right after the connection is closed,
+	with the reason. Set it before the connection starts reading*/
+	void SetCloseHandler(CloseHandler handler)
+	{
+		this->onClosed = std::move(handler);
+	}
+
+	using ViewHandler = std::function<void(std::shared_ptr<Connection<T>>, const MessageView<T>&)>;
+
+	/*With a view handler set, received messages skip the incoming queue. The handler is
+	called on the connection's I/O thread with a view into the receive buffer, which is
+	valid only until the handler returns. Set it before the connection starts reading*/
+	void SetViewHandler(ViewHandler handler)
+	{
+		this->viewHandler = std::move(handler);
+	}
+
+	/*Limits how much a single batched write may carry. At least one message is always
+	sent, even if it is bigger than 'maxBytes' on its own*/
+	void SetWriteBatchLimits(size_t maxBytes, size_t maxBuffers)
+	{
+		this->maxBatchBytes = maxBytes;
+		this->maxBatchBuffers = maxBuffers;
+	}
+
+	/*With fragmentation negotiated, messages with a body over 'size' bytes are sent in
+	fragments of that size, and smaller messages queued after them go out in between. The
+	remote side gets such a message only once it's complete - possibly after the messages
+	which were sent later*/
+	void SetFragmentSize(size_t size)
+	{
+		this->fragmentSize = std::max<size_t>(size, 1);
+	}
+
+	/*Limits how much memory the remote side can make this connection hold. A frame whose body
+	is over 'maxMessageSize' drops the connection before anything is allocated for it.
+	'memoryLimit' covers the receive buffer growing past its default size and, on the server
+	side, received messages which the application hasn't handled yet (see ReleaseReceived).
+	All of it is counted in 'sharedBudget' too, when there is one.
+	While the budget is used up, reading stops until the application handles some of the
+	received messages - of this connection, or of the others when the shared budget is the one
+	used up. Only a frame which wouldn't fit even with nothing else held drops the connection.
+	Set it before the connection starts reading*/
+	void SetMemoryLimits(uint32_t maxMessageSize, size_t memoryLimit, MemoryBudget* sharedBudget = nullptr)
+	{
+		this->maxMessageSize = maxMessageSize;
+		this->memoryBudget.SetLimit(memoryLimit);
+		this->memoryBudget.SetParent(sharedBudget);
+	}
+
+	/*Gives back the budget of a received message once the application is done with it. Can
+	be called from any thread*/
+	void ReleaseReceived(size_t bodySize)
+	{
+		this->memoryBudget.Release(bodySize);
+		this->receivedPending.fetch_sub(bodySize);
+		this->ResumeReading();
+	}
+
+private:
+	/*Message of a queued coalesced entry, it can be replaced until the write chain takes it. Only
+	accessed under 'sendMutex'*/
+	struct CoalescingSlot
+	{
+		SharedMessage<T> msg;
+		uint64_t key = 0;
+	};
+
+	// Coalesced entries have no message of their own until the write chain gets to them
+	struct OutgoingMessage
+	{
+		SharedMessage<T> msg;
+		std::shared_ptr<CoalescingSlot> slot;
+	};
+
+	/*Applies the backpressure policy to a message about to be queued, without holding 'sendMutex'
+	since BLOCK waits here. Returns false if the message mustn't be queued*/
+	bool ApplyBackpressure(bool& dropOldest)
+	{
+		if (!this->IsOverHighWatermark())
+			return true;
+
+		bool isFirst = !this->isBackpressured.exchange(true);
+		if (isFirst && this->onBackpressure)
+			this->onBackpressure(this->shared_from_this());
+
+		switch (this->backpressure.policy)
+		{
+		case BackpressurePolicy::DROP_NEWEST:
+			return false;
+
+		case BackpressurePolicy::DROP_OLDEST:
+			dropOldest = true;
+			return true;
+
+		case BackpressurePolicy::BLOCK:
+			/*Write chains drain the queues on the I/O threads, the connection's own one included.
+			Waiting on any of them could wait for itself, so the message is queued there anyway*/
+			if (IsOnIOThread())
+				return true;
+
+			return this->WaitBelowHighWatermark();
+
+		case BackpressurePolicy::DISCONNECT:
+			// The queue never drains after this, so it's done only once
+			if (isFirst)
 			{
-				/*If the queue has a message in it, then we must 
-				assume that it is in the process of asynchronously being written.
-				Either way add the message to the queue to be output. If no messages
-				were available to be written, then start the process of writing the
-				message at the front of the queue.*/
-				bool isWritingMessage = !messagesOut.IsEmpty();
-				messagesOut.PushBack(msg);
-				if (isWritingMessage)
-					return;
+				std::cout << "[" << id << "] Outgoing Queue Overflow.\n";
+				this->Disconnect(DisconnectReason::QUEUE_OVERFLOW);
+			}
+			return false;
+		}
+
+		return true;
+	}
+
+	// Queues the entry, called under 'sendMutex'. The write chain has to be woken up afterwards
+	void Push(OutgoingMessage&& entry, size_t size, bool dropOldest)
+	{
+		// Counted first, the write chain may take it out right after it's pushed
+		this->queuedBytes += size;
+		this->queuedMessages++;
+
+		if (dropOldest)
+			this->DropOldest();
+
+		/*A full ring doesn't lose the message, it waits in the overflow list until the write
+		chain makes room. Everything sent after it goes there too, so the order is kept. Over
+		the high watermark it goes there anyway, where DROP_OLDEST can still take it back*/
+		if (dropOldest || !this->messagesOverflow.empty() || !this->messagesOut.TryPush(std::move(entry)))
+		{
+			this->messagesOverflow.push_back(std::move(entry));
+			this->hasOverflow.store(true);
+		}
+	}
+
+	/*Puts the message in place of the one with the same key, if that is still queued. Called
+	under 'sendMutex'*/
+	bool ReplaceQueued(const SharedMessage<T>& msg, uint64_t coalesceKey)
+	{
+		auto it = this->coalescingSlots.find(coalesceKey);
+		if (it == this->coalescingSlots.end())
+			return false;
 
-				WriteHeader();
+		CoalescingSlot& slot = *it->second;
+
+		// Takes the place of the old one in the queue, only the size may change
+		this->queuedBytes += msg.Size() - slot.msg.Size();
+		slot.msg = msg;
+		return true;
+	}
+
+	/*Makes room for a new message with BackpressurePolicy::DROP_OLDEST, called under 'sendMutex'.
+	The overflow list is dropped from right here, so a stalled write can't make the queue grow.
+	Messages already in the ring belong to the write chain, it's only asked to drop those -
+	but not more of them than there are*/
+	void DropOldest()
+	{
+		while (this->IsOverHighWatermark() && !this->messagesOverflow.empty())
+		{
+			OutgoingMessage& oldest = this->messagesOverflow.front();
+			size_t size = oldest.msg.Size();
+			if (oldest.slot)
+			{
+				size = oldest.slot->msg.Size();
+				this->coalescingSlots.erase(oldest.slot->key);
 			}
-		);
+
+			this->queuedBytes -= size;
+			this->queuedMessages--;
+			this->messagesOverflow.pop_front();
+		}
+
+		this->hasOverflow.store(!this->messagesOverflow.empty());
+		if (this->IsOverHighWatermark() && this->dropRequests.load() < this->messagesOut.Size())
+			this->dropRequests++;
+	}
+
+	// Front of the outgoing queue, the ring is refilled from the overflow list once it runs empty
+	OutgoingMessage* NextOutgoing()
+	{
+		if (OutgoingMessage* entry = this->messagesOut.Front())
+			return entry;
+
+		if (!this->hasOverflow.load())
+			return nullptr;
+
+		std::scoped_lock lock(this->sendMutex);
+		while (!this->messagesOverflow.empty() && this->messagesOut.TryPush(std::move(this->messagesOverflow.front())))
+			this->messagesOverflow.pop_front();
+
+		this->hasOverflow.store(!this->messagesOverflow.empty());
+		return this->messagesOut.Front();
+	}
+
+	bool IsOutgoingEmpty() const
+	{
+		return this->messagesOut.IsEmpty() && !this->hasOverflow.load();
+	}
+
+	bool IsOverHighWatermark() const
+	{
+		return this->queuedBytes.load() >= this->backpressure.highBytes ||
+			this->queuedMessages.load() >= this->backpressure.highMessages;
+	}
+
+	/*True on a thread inside io_context::run, of this connection's context or any other one.
+	asio has no public way to ask that for every context at once*/
+	static bool IsOnIOThread()
+	{
+		return asio::detail::thread_context::top_of_thread_call_stack() != nullptr;
+	}
+
+	// Returns false if the connection was closed while waiting
+	bool WaitBelowHighWatermark()
+	{
+		this->blockedSenders++;
+		{
+			/*Woken up by the write chain, the timeout only makes sure that a closed
+			connection doesn't keep the sender here forever*/
+			std::unique_lock lock(this->blockedMutex);
+			while (this->IsOverHighWatermark() && this->IsConnected())
+				this->belowHighWatermark.wait_for(lock, std::chrono::milliseconds(10));
+		}
+		this->blockedSenders--;
+
+		return this->IsConnected();
+	}
+
+	// Called by the write chain for every message which leaves the outgoing queue for good
+	void OnMessageTaken(size_t size)
+	{
+		this->queuedBytes -= size;
+		this->queuedMessages--;
+
+		if (this->blockedSenders.load() > 0)
+		{
+			std::scoped_lock lock(this->blockedMutex);
+			this->belowHighWatermark.notify_all();
+		}
+
+		bool isDrained = this->queuedBytes.load() <= this->backpressure.lowBytes &&
+			this->queuedMessages.load() <= this->backpressure.lowMessages;
+		if (isDrained && this->isBackpressured.load() && this->isBackpressured.exchange(false) && this->onDrained)
+			this->onDrained(this->shared_from_this());
+	}
+
+	void WakeWriter()
+	{
+		/*The write chain runs on the connection's context. While it's busy it will pick up
+		the message on its own, we only have to wake it up when it went idle*/
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!this->isWriting.exchange(true, std::memory_order_acq_rel))
+			asio::post(this->context, [this]() { WriteMessages(); });
 	}
 
-private:
 	// Asynchronous method
-	void WriteHeader()
+	void WriteMessages()
 	{
-		/*If this function is called, we know the outgoing message queue must have
-		at least one message to send. So allocate a transmission buffer to hold
-		the message, and issue the work - asio, send these bytes*/
-		asio::async_write(
-			this->socket, asio::buffer(&this->messagesOut.Front().header, sizeof(MessageHeader<T>)),
+		/*If this function is called, we know there is at least one frame to send. Every
+		message queued at this moment (up to the batch limits) is moved into the in flight
+		list, and all of them are handed to asio as one scatter-gather buffer sequence, so
+		the whole batch goes out in a single write. Encoded headers and control frames
+		are written to the scratch buffer, which is sized up front so pointers into it
+		stay valid*/
+		size_t scratchNeeded = (this->controlsOut.size() + this->maxBatchBuffers + 1) *
+			(FrameCodec<T>::maxHeaderSize + controlBodySize + FrameCodec<T>::checksumSize);
+		if (this->writeScratch.size() < scratchNeeded)
+			this->writeScratch.resize(scratchNeeded);
+
+		uint8_t* scratch = this->writeScratch.data();
+		size_t batchBytes = 0;
+
+		// Control frames go first, they are tiny and some of them change how the frames after them are encoded
+		while (!this->controlsOut.empty())
+		{
+			const ControlFrame& control = this->controlsOut.front();
+			size_t headerSize = FrameCodec<T>::EncodeHeader(
+				{ T(), uint32_t(control.body.size()), FrameFlags::CONTROL }, this->writeOptions, scratch);
+			std::memcpy(scratch + headerSize, control.body.data(), control.body.size());
+
+			size_t frameSize = headerSize + control.body.size();
+			if (this->writeOptions.checksums)
+			{
+				FrameCodec<T>::EncodeChecksum(Crc32c::Compute(scratch, frameSize), scratch + frameSize);
+				frameSize += FrameCodec<T>::checksumSize;
+			}
+
+			this->writeBuffers.push_back(asio::buffer(scratch, frameSize));
+			scratch += frameSize;
+			batchBytes += frameSize;
+
+			if (control.nextWriteOptions)
+				this->writeOptions = *control.nextWriteOptions;
+
+			this->controlsOut.pop_front();
+		}
+
+		/*In the raw format the serialized block of a shared message is exactly the frame. Other
+		formats need their own header in front of the body. Checksums can't be stored in the
+		shared block, since other connections may not use them - they go to the scratch buffer
+		as a separate trailer*/
+		while (OutgoingMessage* entry = this->NextOutgoing())
+		{
+			/*A coalesced message is taken out of its slot when its turn comes. The slot goes
+			away with it, sending with the same key after that queues a new one*/
+			if (std::shared_ptr<CoalescingSlot> slot = std::move(entry->slot))
+			{
+				std::scoped_lock lock(this->sendMutex);
+				entry->msg = std::move(slot->msg);
+				this->coalescingSlots.erase(slot->key);
+			}
+
+			SharedMessage<T>* next = &entry->msg;
+
+			// Dropped to make room for newer ones, unless part of it is sent already
+			if (this->dropRequests.load() > 0 && this->envelopeOffset == 0)
+			{
+				this->dropRequests--;
+				this->OnMessageTaken(next->Size());
+				this->messagesOut.PopFront();
+				continue;
+			}
+			/*An expansion which is already started is finished the same way, even if envelopes were
+			negotiated in the meantime - sending the whole envelope would repeat what is sent already*/
+			if (this->envelopeOffset > 0 || ((next->Flags() & FrameFlags::ENVELOPE) && !this->writeOptions.envelopes))
+			{
+				if (!this->ExpandEnvelope(*next, scratch, batchBytes))
+					break;
+
+				this->OnMessageTaken(next->Size());
+				this->messagesInFlight.push_back(std::move(*next));
+				this->messagesOut.PopFront();
+				continue;
+			}
+
+			/*Large messages are set aside and sent in fragments after everything else of
+			the batch, so they don't hold back the small ones*/
+			if (this->writeOptions.fragmentation && next->BodySize() > this->fragmentSize)
+			{
+				this->largeMessagesOut.push_back(std::move(*next));
+				this->messagesOut.PopFront();
+				continue;
+			}
+
+			size_t buffersNeeded = 1 + (this->writeOptions.compactHeaders ? 1 : 0) + (this->writeOptions.checksums ? 1 : 0);
+			bool isBatchFull = this->writeBuffers.size() + buffersNeeded > this->maxBatchBuffers ||
+				batchBytes + next->Size() > this->maxBatchBytes;
+			if (!this->writeBuffers.empty() && isBatchFull)
+				break;
+
+			this->OnMessageTaken(next->Size());
+			this->messagesInFlight.push_back(std::move(*next));
+			this->messagesOut.PopFront();
+
+			const SharedMessage<T>& msg = this->messagesInFlight.back();
+			if (this->writeOptions.compactHeaders)
+			{
+				batchBytes += this->AddFrame({ msg.Header().id, uint32_t(msg.BodySize()), msg.Flags() }, msg.Body(), scratch);
+				continue;
+			}
+
+			this->writeBuffers.push_back(asio::buffer(msg.Data(), msg.Size()));
+			batchBytes += msg.Size();
+
+			if (this->writeOptions.checksums)
+			{
+				FrameCodec<T>::EncodeChecksum(msg.Checksum(), scratch);
+				this->writeBuffers.push_back(asio::buffer(scratch, FrameCodec<T>::checksumSize));
+				scratch += FrameCodec<T>::checksumSize;
+				batchBytes += FrameCodec<T>::checksumSize;
+			}
+		}
+
+		// Nothing older is left to drop for the messages which are still to come
+		if (this->IsOutgoingEmpty())
+			this->dropRequests = 0;
+
+		/*Every batch carries at least one fragment of the large message being sent, more only
+		while they fit. The fragments point straight into the shared block*/
+		bool hasFragment = false;
+		while (!this->largeMessagesOut.empty())
+		{
+			const SharedMessage<T>& msg = this->largeMessagesOut.front();
+			size_t chunkSize = std::min(this->fragmentSize, msg.BodySize() - this->fragmentOffset);
+
+			size_t buffersNeeded = this->writeOptions.checksums ? 3 : 2;
+			bool isBatchFull = this->writeBuffers.size() + buffersNeeded > this->maxBatchBuffers ||
+				batchBytes + chunkSize > this->maxBatchBytes;
+			if (hasFragment && isBatchFull)
+				break;
+
+			bool isLast = this->fragmentOffset + chunkSize == msg.BodySize();
+			uint8_t flags = msg.Flags() | FrameFlags::FRAGMENT | (isLast ? FrameFlags::LAST_FRAGMENT : FrameFlags::NONE);
+			batchBytes += this->AddFrame({ msg.Header().id, uint32_t(chunkSize), flags }, msg.Body() + this->fragmentOffset, scratch);
+			this->fragmentOffset += chunkSize;
+			hasFragment = true;
+
+			if (!isLast)
+				continue;
+
+			// Kept alive together with the rest of the batch until the write completes
+			this->OnMessageTaken(msg.Size());
+			this->messagesInFlight.push_back(std::move(this->largeMessagesOut.front()));
+			this->largeMessagesOut.pop_front();
+			this->fragmentOffset = 0;
+		}
+
+		if (this->writeTimeout.count() > 0)
+		{
+			this->writeTimer.expires_after(this->writeTimeout);
+			this->writeTimer.async_wait([this](asio::error_code ec)
+				{
+					// A handler which was already queued can't be cancelled, so the expiry is checked as well
+					if (ec || writeTimer.expiry() > std::chrono::steady_clock::now())
+						return;
+
+					std::cout << "[" << id << "] Write Deadline Exceeded.\n";
+					Close(DisconnectReason::WRITE_TIMEOUT);
+				}
+			);
+		}
+
+		// The rate is measured from the moment the write chain gets busy
+		if (this->minBytesPerSecond && this->rateWindow.count() > 0 &&
+			this->rateWindowStart == std::chrono::steady_clock::time_point())
+		{
+			this->rateWindowStart = std::chrono::steady_clock::now();
+			this->rateWindowBytes = 0;
+			this->WaitForRateWindowEnd();
+		}
+
+		asio::async_write(this->socket, this->writeBuffers,
 			[this](asio::error_code ec, size_t length)
 			{
+				// Cancels the deadline, and moves it far enough that one already queued sees it's not due
+				if (writeTimeout.count() > 0)
+					writeTimer.expires_at(std::chrono::steady_clock::time_point::max());
+
 				if (ec)
 				{
 					/*asio has now sent the bytes - if there was a problem, an error would be
-					available - asio failed to write the message, we could analyse why but
+					available - asio failed to write the messages, we could analyse why but
 					for now simply assume the connection has died by closing the
 					socket. When a future attempt to write to this client fails due
 					to the closed socket, it will be tidied up.*/
-					std::cout << "[" << id << "] Write Header Fail.\n";
-					socket.close();
+					std::cout << "[" << id << "] Write Messages Fail.\n";
+					Close(DisconnectReason::WRITE_FAILED);
 					return;
 				}
 
-				if (messagesOut.Front().body.size() > 0) // If message contains body
+				/* Sending was successful, so we are done with the whole batch*/
+				writeBuffers.clear();
+				messagesInFlight.clear();
+				rateWindowBytes += length;
+
+				/*If the queue is not empty, more messages arrived while the batch was
+				being written, so issue the task to send them as the next batch. Otherwise
+				go idle - but a message pushed right before that wouldn't wake us up,
+				so check the queue once more after announcing it*/
+				if (IsOutgoingEmpty() && controlsOut.empty() && largeMessagesOut.empty())
 				{
-					WriteBody();
-					return;
-				}
+					// Time without anything to write doesn't count against the rate
+					if (rateWindowStart != std::chrono::steady_clock::time_point())
+					{
+						rateWindowStart = std::chrono::steady_clock::time_point();
+						rateTimer.expires_at(std::chrono::steady_clock::time_point::max());
+					}
 
-				messagesOut.PopFront();
+					isWriting.store(false, std::memory_order_relaxed);
+					std::atomic_thread_fence(std::memory_order_seq_cst);
+					if (IsOutgoingEmpty() || isWriting.exchange(true, std::memory_order_acq_rel))
+						return;
+				}
 
-				/*If the queue is not empty, there are more messages to send, so
-				make this happen by issuing the task to send the next header.*/
-				if (!messagesOut.IsEmpty())
-					WriteHeader();
+				WriteMessages();
 			}
 		);
 	}
 
-	// Asynchronous method
-	void WriteBody()
+	/*At the end of every rate window the bytes written in it are checked against the minimum
+	rate, a write which is still in progress counts as nothing written yet. So the window has
+	to be long enough for a whole batch at the minimum rate*/
+	void WaitForRateWindowEnd()
 	{
-		/*If this function is called, a header has just been sent, and that header
-		indicated a body existed for this message. Fill a transmission buffer
-		with the body data, and send it!*/
-		asio::async_write(this->socket, asio::buffer(messagesOut.Front().body.data(), messagesOut.Front().body.size()),
-			[this](asio::error_code ec, size_t length)
+		this->rateTimer.expires_after(this->rateWindow);
+		this->rateTimer.async_wait([this](asio::error_code ec)
 			{
-				if (ec)
+				// A handler which was already queued can't be cancelled, so the expiry is checked as well
+				if (ec || rateTimer.expiry() > std::chrono::steady_clock::now())
+					return;
+
+				auto now = std::chrono::steady_clock::now();
+				std::chrono::duration<double> elapsed = now - rateWindowStart;
+				if (rateWindowBytes < minBytesPerSecond * elapsed.count())
 				{
-					// Sending failed, see WriteHeader() equivalent for description :P
-					std::cout << "[" << id << "] Write Body Fail.\n";
-					socket.close();
+					std::cout << "[" << id << "] Too Slow To Keep Up.\n";
+					Close(DisconnectReason::TOO_SLOW);
 					return;
 				}
 
-				/* Sending was successful, so we are done with the messageand remove it
-				from the queue*/
-				messagesOut.PopFront();
-
-				/*If the queue still has messages in it, then issue the task to
-				send the next messages' header.*/
-				if (!messagesOut.IsEmpty())
-					WriteHeader();
+				rateWindowStart = now;
+				rateWindowBytes = 0;
+				WaitForRateWindowEnd();
 			}
 		);
 	}
 
+	// Closes the socket, called only on the connection's context
+	void Close(DisconnectReason reason)
+	{
+		DisconnectReason none = DisconnectReason::NONE;
+		bool isFirst = this->disconnectReason.compare_exchange_strong(none, reason);
+		this->socket.close();
+
+		// Posted, since this can run in the middle of reading or writing
+		if (isFirst && this->onClosed)
+			asio::post(this->context, [self = this->shared_from_this(), reason]() { self->onClosed(self, reason); });
+	}
+
+	/*Adds a frame whose header is encoded into the scratch buffer, followed by the body right
+	from where it is. Returns how many bytes it takes on the wire*/
+	size_t AddFrame(const FrameHeader<T>& header, const uint8_t* body, uint8_t*& scratch)
+	{
+		size_t headerSize = FrameCodec<T>::EncodeHeader(header, this->writeOptions, scratch);
+		this->writeBuffers.push_back(asio::buffer(scratch, headerSize));
+		this->writeBuffers.push_back(asio::buffer(body, header.size));
+
+		size_t frameSize = headerSize + header.size;
+		if (this->writeOptions.checksums)
+		{
+			uint32_t checksum = Crc32c::Compute(body, header.size, Crc32c::Compute(scratch, headerSize));
+			FrameCodec<T>::EncodeChecksum(checksum, scratch + headerSize);
+			this->writeBuffers.push_back(asio::buffer(scratch + headerSize, FrameCodec<T>::checksumSize));
+			headerSize += FrameCodec<T>::checksumSize;
+			frameSize += FrameCodec<T>::checksumSize;
+		}
+
+		scratch += headerSize;
+		return frameSize;
+	}
+
+	/*Sends the messages of an envelope one by one, for remote sides which can't unpack it.
+	Returns false if the batch filled up first, the next batch goes on from 'envelopeOffset'*/
+	bool ExpandEnvelope(const SharedMessage<T>& envelope, uint8_t*& scratch, size_t& batchBytes)
+	{
+		size_t startOffset = this->envelopeOffset;
+		while (this->envelopeOffset < envelope.BodySize())
+		{
+			size_t offset = this->envelopeOffset;
+			MessageHeader<T> header;
+			const uint8_t* body = nullptr;
+
+			// Envelopes are built by MessageBatch, so this can't happen - but nothing after a broken entry can be read
+			if (!MessageBatch<T>::ReadEntry(envelope.Body(), envelope.BodySize(), offset, header, body))
+				break;
+
+			size_t buffersNeeded = this->writeOptions.checksums ? 3 : 2;
+			bool isBatchFull = this->writeBuffers.size() + buffersNeeded > this->maxBatchBuffers ||
+				batchBytes + header.size > this->maxBatchBytes;
+			if (!this->writeBuffers.empty() && isBatchFull)
+			{
+				// The part added to this batch points into the envelope, so it has to stay alive with it
+				if (this->envelopeOffset != startOffset)
+					this->messagesInFlight.push_back(envelope);
+
+				return false;
+			}
+
+			batchBytes += this->AddFrame({ header.id, header.size }, body, scratch);
+			this->envelopeOffset = offset;
+		}
+
+		this->envelopeOffset = 0;
+		return true;
+	}
+
 	// Asynchronous method
-	void ReadHeader()
-	{
-		/*If this function is called, we are expecting asio to wait until it receives
-		enough bytes to form a header of a message. We know the headers are a fixed
-		size, so allocate a transmission buffer large enough to store it. In fact, 
-		we will construct the message in a "temporary" message object as it's 
-		convenient to work with.*/
-		asio::async_read(this->socket, asio::buffer(&this->tempMsgIn.header, sizeof(MessageHeader<T>)),
+	void ReadMessages()
+	{
+		/*Instead of waiting for exactly one header and then exactly one body, we ask
+		asio for whatever bytes have already arrived and append them to the receive
+		buffer. Before that, make sure there is free space at the end of it - unparsed
+		bytes are moved to the front, and the buffer only grows when a single message
+		doesn't fit into it.*/
+		if (this->readEnd == this->readBuffer.size())
+		{
+			std::memmove(this->readBuffer.data(), this->readBuffer.data() + this->readBegin, this->readEnd - this->readBegin);
+			this->readEnd -= this->readBegin;
+			this->readBegin = 0;
+		}
+
+		size_t requiredSize = std::max(this->requiredReadSize,
+			this->readEnd == this->readBuffer.size() ? this->readBuffer.size() * 2 : 0);
+		size_t growth = requiredSize > this->readBuffer.size() ? requiredSize - this->readBuffer.size() : 0;
+
+		if (!this->HasMemoryToRead(growth))
+		{
+			/*With nothing of this connection waiting to be handled, only the other connections
+			can free the shared budget - and if the frame wouldn't fit even then, waiting
+			wouldn't help*/
+			bool isWaitingForOthers = this->receivedPending.load() == 0;
+			if (isWaitingForOthers && !this->memoryBudget.CouldFit(growth))
+			{
+				std::cout << "[" << id << "] Memory Budget Exceeded.\n";
+				Close(DisconnectReason::MEMORY_BUDGET);
+				return;
+			}
+
+			/*Wait until the application handles some of the received messages, ReleaseReceived
+			or the shared budget resume reading then. That could've happened right before the
+			flag was set though, so check once more*/
+			this->isReadPaused = true;
+			if (isWaitingForOthers)
+			{
+				this->memoryBudget.WaitForParentRelease([weak = this->weak_from_this()]()
+					{
+						if (auto self = weak.lock())
+							self->ResumeReading();
+					}
+				);
+			}
+
+			if (!this->HasMemoryToRead(growth))
+				return;
+
+			if (!this->isReadPaused.exchange(false))
+			{
+				// Reading was resumed by someone else first
+				this->memoryBudget.Release(growth);
+				return;
+			}
+		}
+
+		if (growth)
+			this->readBuffer.resize(requiredSize);
+
+		this->socket.async_read_some(
+			asio::buffer(this->readBuffer.data() + this->readEnd, this->readBuffer.size() - this->readEnd),
 			[this](asio::error_code ec, size_t length)
 			{
 				if (ec)
 				{
-					/*Reading form the client went wrong, most likely a disconnect
+					/*Reading form the remote side went wrong, most likely a disconnect
 					has occurred. Close the socket and let the system tidy it up later.*/
-					std::cout << "[" << id << "] Read Header Fail.\n";
-					socket.close();
+					std::cout << "[" << id << "] Read Messages Fail.\n";
+					Close(DisconnectReason::REMOTE);
 					return;
 				}
 
-				if (tempMsgIn.header.size == 0)
+				readEnd += length;
+				if (!ParseMessages())
 				{
-					AddToIncomingMessageQueue();
+					std::cout << "[" << id << "] Invalid Frame Received.\n";
+					Close(DisconnectReason::INVALID_FRAME);
 					return;
 				}
 
-				tempMsgIn.body.resize(tempMsgIn.header.size);
-				ReadBody();
+				/*We must now prime the asio context to receive the next bytes. It 
+				will just sit and wait for them to arrive, and the message construction
+				process repeats itself. Clever huh?*/
+				ReadMessages();
 			}
 		);
 	}
 
-	// Asynchronous method
-	void ReadBody()
+	void ResumeReading()
 	{
-		/*If this function is called, a header has already been read, and that header
-		request we read a body, The space for that body has already been allocated
-		in the temporary message object, so just wait for the bytes to arrive...*/
-		asio::async_read(this->socket, asio::buffer(this->tempMsgIn.body.data(), this->tempMsgIn.body.size()),
-			[this](asio::error_code ec, size_t length)
+		if (this->isReadPaused.exchange(false))
+			asio::post(this->context, [self = this->shared_from_this()]() { self->ReadMessages(); });
+	}
+
+	/*Growing the receive buffer takes memory from the budget, which is kept on success.
+	Without growing, messages waiting to be handled mustn't have used it up*/
+	bool HasMemoryToRead(size_t growth)
+	{
+		if (growth)
+			return this->memoryBudget.TryAcquire(growth);
+
+		return this->receivedPending.load() == 0 || !this->memoryBudget.IsExhausted();
+	}
+
+	// Returns false if the remote side sent something which isn't a valid frame, or a corrupted one
+	bool ParseMessages()
+	{
+		/*A single read can hold any number of messages, and the last one may be cut in half.
+		Pull out every complete message and leave the incomplete rest in the buffer
+		until the following read completes it*/
+		auto conn = this->owner == Owner::SERVER ? this->shared_from_this() : nullptr;
+		this->requiredReadSize = 0;
+		while (this->readBegin < this->readEnd)
+		{
+			const uint8_t* frame = this->readBuffer.data() + this->readBegin;
+			size_t available = this->readEnd - this->readBegin;
+
+			FrameHeader<T> header;
+			size_t headerSize = 0;
+			if (!FrameCodec<T>::DecodeHeader(frame, available, this->readOptions, header, headerSize))
+				return false;
+
+			if (headerSize == 0)
+				break;
+
+			// Rejected before the receive buffer grows for it, control frames have a fixed size
+			bool isControl = header.flags & FrameFlags::CONTROL;
+			if (isControl ? header.size != controlBodySize : header.size > this->maxMessageSize)
+				return false;
+
+			size_t frameSize = headerSize + header.size + FrameCodec<T>::TrailerSize(this->readOptions);
+			if (available < frameSize)
 			{
-				if (ec)
-				{
-					std::cout << "[" << id << "] Read Body Fail.\n";
-					socket.close();
-					return;
-				}
+				// Make sure the rest of a large message will fit once the buffer is compacted
+				this->requiredReadSize = frameSize;
 
-				AddToIncomingMessageQueue();
+				break;
 			}
-		);
+
+			if (this->readOptions.checksums)
+			{
+				size_t checkedSize = headerSize + header.size;
+				if (Crc32c::Compute(frame, checkedSize) != FrameCodec<T>::DecodeChecksum(frame + checkedSize))
+					return false;
+			}
+
+			// Consumed before it's handled, since a control frame can change how the next frames are read
+			this->readBegin += frameSize;
+
+			const uint8_t* body = frame + headerSize;
+			if (header.flags & FrameFlags::CONTROL)
+				this->HandleControl(body);
+			else if (header.flags & FrameFlags::FRAGMENT)
+			{
+				if (!this->HandleFragment(conn, header, body))
+					return false;
+			}
+			else if (header.flags & FrameFlags::ENVELOPE)
+			{
+				if (!this->HandleEnvelope(conn, body, header.size))
+					return false;
+			}
+			else
+				this->DeliverMessage(conn, { header.id, header.size }, body);
+		}
+
+		if (this->readBegin == this->readEnd)
+		{
+			this->readBegin = this->readEnd = 0;
+
+			// A large message is gone, don't keep holding its memory
+			if (this->readBuffer.size() > defaultReadBufferSize)
+			{
+				this->memoryBudget.Release(this->readBuffer.size() - defaultReadBufferSize);
+				this->readBuffer.resize(defaultReadBufferSize);
+				this->readBuffer.shrink_to_fit();
+			}
+		}
+
+		return true;
+	}
+
+	/*Negotiation of wire options takes three frames, all of them sent in the format which was
+	used so far. The server switches its writing after its answer and the client switches its
+	reading after receiving it. Then the client switches its writing after the confirmation,
+	and the server switches its reading after receiving that one*/
+	void HandleControl(const uint8_t* body)
+	{
+		WireOptions options = WireOptions::FromBits(body[1]);
+		switch (ControlType(body[0]))
+		{
+		case ControlType::NEGOTIATE_REQUEST:
+			if (this->owner != Owner::SERVER)
+				return;
+
+			this->pendingReadOptions = options.Intersect(this->allowedOptions);
+			this->SendControl(ControlType::NEGOTIATE_ACCEPT, this->pendingReadOptions.ToBits(), this->pendingReadOptions);
+			break;
+
+		case ControlType::NEGOTIATE_ACCEPT:
+			if (this->owner != Owner::CLIENT)
+				return;
+
+			this->readOptions = options;
+			this->SendControl(ControlType::NEGOTIATE_CONFIRM, options.ToBits(), options);
+			break;
+
+		case ControlType::NEGOTIATE_CONFIRM:
+			if (this->owner != Owner::SERVER)
+				return;
+
+			this->readOptions = this->pendingReadOptions;
+			break;
+		}
+	}
+
+	/*Queues a control frame, 'nextWriteOptions' are used for everything written after it.
+	Called only on the connection's context*/
+	void SendControl(ControlType type, uint8_t value, std::optional<WireOptions> nextWriteOptions = std::nullopt)
+	{
+		this->controlsOut.push_back({ { uint8_t(type), value }, nextWriteOptions });
+
+		if (!this->isWriting.exchange(true, std::memory_order_acq_rel))
+			this->WriteMessages();
+	}
+
+	/*Fragments of one message are collected until the last one arrives, other messages can
+	come in between them. Returns false if the fragments don't add up to a valid message*/
+	bool HandleFragment(const std::shared_ptr<Connection<T>>& conn, const FrameHeader<T>& header, const uint8_t* body)
+	{
+		size_t offset = this->reassembly.body.size();
+		if (offset == 0)
+		{
+			this->reassembly.header.id = header.id;
+			this->reassemblyFlags = header.flags & FrameFlags::ENVELOPE;
+		}
+		else if (this->reassembly.header.id != header.id)
+			return false;
+
+		if (offset + header.size > this->maxMessageSize)
+			return false;
+
+		// Already received, so it can't be refused - but it's counted, which stops reading while over budget
+		this->memoryBudget.Acquire(header.size);
+		this->reassembly.body.resize(offset + header.size);
+		std::memcpy(this->reassembly.body.data() + offset, body, header.size);
+
+		if (!(header.flags & FrameFlags::LAST_FRAGMENT))
+			return true;
+
+		Message<T> msg = std::move(this->reassembly);
+		this->reassembly = Message<T>();
+		msg.header.size = uint32_t(msg.body.size());
+		this->memoryBudget.Release(msg.body.size());
+
+		if (this->reassemblyFlags & FrameFlags::ENVELOPE)
+			return this->HandleEnvelope(conn, msg.body.data(), msg.body.size());
+
+		if (this->viewHandler)
+			this->viewHandler(conn, MessageView<T>{ msg.header, msg.body.data() });
+		else
+			this->QueueMessage(conn, std::move(msg));
+
+		return true;
+	}
+
+	// Every message of an envelope is delivered on its own. Returns false if it isn't a valid envelope
+	bool HandleEnvelope(const std::shared_ptr<Connection<T>>& conn, const uint8_t* data, size_t size)
+	{
+		size_t offset = 0;
+		while (offset < size)
+		{
+			MessageHeader<T> header;
+			const uint8_t* body = nullptr;
+			if (!MessageBatch<T>::ReadEntry(data, size, offset, header, body))
+				return false;
+
+			this->DeliverMessage(conn, header, body);
+		}
+
+		return true;
+	}
+
+	void DeliverMessage(const std::shared_ptr<Connection<T>>& conn, const MessageHeader<T>& header, const uint8_t* body)
+	{
+		if (this->viewHandler)
+		{
+			// Nothing is copied, the handler looks straight into the receive buffer
+			this->viewHandler(conn, MessageView<T>{ header, body });
+			return;
+		}
+
+		Message<T> msg;
+		msg.header = header;
+		msg.body.assign(body, body + header.size);
+		this->QueueMessage(conn, std::move(msg));
 	}
 
-	void AddToIncomingMessageQueue()
+	void QueueMessage(const std::shared_ptr<Connection<T>>& conn, Message<T>&& msg)
 	{
+		size_t bodySize = msg.body.size();
+
+		// On the server Update gives it back through ReleaseReceived once the message is handled
+		if (this->owner == Owner::SERVER)
+		{
+			this->memoryBudget.Acquire(bodySize);
+			this->receivedPending.fetch_add(bodySize);
+		}
+
 		/*Shove it in queue, converting it to an "owned message", by initialising
 		with the a shared pointer from this connection object*/
-		auto conn = this->owner == Owner::SERVER ? this->shared_from_this() : nullptr;
-		this->messagesIn.PushBack({ conn, this->tempMsgIn });
-
-		/*We must now prime the asio context to receive the next message. It 
-		will just sit and wait for bytes to arrive, and the message construction
-		process repeats itself. Clever huh?*/
-		this->ReadHeader();
+		this->messagesIn.PushBack({ conn, std::move(msg) });
 	}
 
 protected:
@@ -222,19 +1126,130 @@ protected:
 
 	asio::io_context& context; // this will be shared with the whole asio instance
 
-	//This queue holds all the messages to be sent to the remote side of the connection
-	TSQueue<Message<T>> messagesOut;
+	/*This queue holds all the messages to be sent to the remote side of the connection.
+	They are shared, so a message broadcast to many connections exists only once. Senders
+	push into it one at a time under 'sendMutex' and only the write chain pops from it, so
+	it's a single producer, single consumer ring - the write chain never takes the lock
+	unless the ring overflowed*/
+	SPSCRing<OutgoingMessage> messagesOut;
+
+	// Guards the producer side of 'messagesOut' and everything below up to 'coalescingSlots'
+	std::mutex sendMutex;
+
+	/*Messages sent while the ring was full, in order. The write chain moves them into the ring
+	once it's empty, 'hasOverflow' lets it check for them without taking the lock*/
+	std::deque<OutgoingMessage> messagesOverflow;
+	std::atomic<bool> hasOverflow = false;
+
+	// Slots of the coalesced entries which are still queued, by key
+	std::unordered_map<uint64_t, std::shared_ptr<CoalescingSlot>> coalescingSlots;
+
+	/*Messages and bytes in the outgoing queue which aren't handed to the socket yet, including
+	large messages waiting for their fragments to be sent*/
+	std::atomic<size_t> queuedBytes = 0;
+	std::atomic<size_t> queuedMessages = 0;
+
+	BackpressureOptions backpressure;
+	BackpressureHandler onBackpressure;
+	BackpressureHandler onDrained;
+	std::atomic<bool> isBackpressured = false;
+
+	// Deadline of the write in progress, see SetWriteDeadlines
+	asio::steady_timer writeTimer;
+	std::chrono::milliseconds writeTimeout{ 0 };
+
+	/*Bytes written since the start of the current rate window, which starts when the write
+	chain gets busy and ends after 'rateWindow'*/
+	asio::steady_timer rateTimer;
+	size_t minBytesPerSecond = 0;
+	std::chrono::milliseconds rateWindow{ 0 };
+	std::chrono::steady_clock::time_point rateWindowStart;
+	size_t rateWindowBytes = 0;
+
+	std::atomic<DisconnectReason> disconnectReason = DisconnectReason::NONE;
+	CloseHandler onClosed;
+
+	// Oldest messages the write chain should drop, see BackpressurePolicy::DROP_OLDEST
+	std::atomic<size_t> dropRequests = 0;
+
+	// Senders waiting with BackpressurePolicy::BLOCK
+	std::atomic<size_t> blockedSenders = 0;
+	std::mutex blockedMutex;
+	std::condition_variable belowHighWatermark;
+
+	// True while the write chain is running or about to run on the context
+	std::atomic<bool> isWriting = false;
+
+	/*Messages of the batch currently being written. They are kept alive here until
+	asio reports that the write has completed, since 'writeBuffers' points into them*/
+	std::vector<SharedMessage<T>> messagesInFlight;
+	std::vector<asio::const_buffer> writeBuffers;
+
+	size_t maxBatchBytes = 64 * 1024;
+	size_t maxBatchBuffers = 64;
+
+	static constexpr size_t controlBodySize = 2;
+
+	struct ControlFrame
+	{
+		std::array<uint8_t, controlBodySize> body;
+		std::optional<WireOptions> nextWriteOptions;
+	};
+
+	/*Control frames are created and sent only on the connection's context, so unlike
+	'messagesOut' this needs no synchronization*/
+	std::deque<ControlFrame> controlsOut;
+
+	// Encoded frame headers and control frames of the batch being written
+	std::vector<uint8_t> writeScratch;
+
+	/*Messages which are sent in fragments, one after another. 'fragmentOffset' is how much
+	of the first one is sent already*/
+	std::deque<SharedMessage<T>> largeMessagesOut;
+	size_t fragmentOffset = 0;
+	size_t fragmentSize = 64 * 1024;
+
+	// How much of the envelope at the front of 'messagesOut' is sent already, see ExpandEnvelope
+	size_t envelopeOffset = 0;
+
+	// Format of the frames being written and read, see HandleControl
+	WireOptions writeOptions;
+	WireOptions readOptions;
+	WireOptions pendingReadOptions;
+	WireOptions allowedOptions = WireOptions::All();
 
 	/*This queue will hold all the messages that have been received from the remote side of the
 	connection. It's the reference since the owner of this connection is supposed to provide
 	the queue*/
-	TSQueue<OwnedMessage<T>>& messagesIn;
+	IncomingQueue<T>& messagesIn;
+
+	// Optional receiver of messages which bypass 'messagesIn'
+	ViewHandler viewHandler;
+
+	// Fragments of the message being received, empty until the first one arrives
+	Message<T> reassembly;
+	uint8_t reassemblyFlags = FrameFlags::NONE;
 
 	Owner owner; // The "owner" decides how some of the connection behaves
 
-	/*Incoming messages are constructed asynchronously, so we will
-	store the part assembled message here, until it is ready*/
-	Message<T> tempMsgIn;
+	/*Incoming bytes are collected here. Everything between 'readBegin' and 'readEnd'
+	is received but not yet parsed - usually the beginning of a message that hasn't
+	fully arrived yet*/
+	static constexpr size_t defaultReadBufferSize = 16 * 1024;
+	std::vector<uint8_t> readBuffer = std::vector<uint8_t>(defaultReadBufferSize);
+	size_t readBegin = 0;
+	size_t readEnd = 0;
+
+	// Size the receive buffer must have for the incomplete frame in it
+	size_t requiredReadSize = 0;
+
+	uint32_t maxMessageSize = FrameCodec<T>::maxBodySize;
+
+	/*Counts the receive buffer past its default size and the received messages which are
+	queued but not handled yet. 'receivedPending' is just the latter*/
+	MemoryBudget memoryBudget;
+	std::atomic<size_t> receivedPending = 0;
+	std::atomic<bool> isReadPaused = false;
 
 	uint32_t id = 0;
 };
\ No newline at end of file
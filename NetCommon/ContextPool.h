@@ -0,0 +1,71 @@
+#pragma once
+#include "Utilities.h"
+
+/*Pool of io_contexts where each one is run by its own thread. A connection is bound to one
+of the contexts for its whole life, so its reads and writes are still handled one after
+another, but different connections are handled in parallel on different cores*/
+class ContextPool
+{
+public:
+	explicit ContextPool(size_t size)
+	{
+		size = std::max<size_t>(size, 1);
+		for (size_t i = 0; i < size; i++)
+		{
+			/*Hints that only one thread runs the context. asio keeps its locking on though, other
+			threads still post to it*/
+			this->contexts.push_back(std::make_unique<asio::io_context>(1));
+
+			// Keeps the thread inside run() while its context has nothing to do yet
+			this->workGuards.push_back(asio::make_work_guard(*this->contexts.back()));
+		}
+	}
+
+	ContextPool(const ContextPool&) = delete;
+
+	~ContextPool()
+	{
+		this->Stop();
+	}
+
+	void Run()
+	{
+		if (!this->threads.empty())
+			return;
+
+		for (auto& context : this->contexts)
+			this->threads.emplace_back([&context]() { context->run(); });
+	}
+
+	void Stop()
+	{
+		for (auto& context : this->contexts)
+			context->stop();
+
+		for (auto& thread : this->threads)
+			thread.join();
+
+		this->threads.clear();
+
+		// Allows the pool to be run again later
+		for (auto& context : this->contexts)
+			context->restart();
+	}
+
+	// Contexts are handed out in round robin order, which spreads connections evenly
+	asio::io_context& Next()
+	{
+		return *this->contexts[this->nextContext++ % this->contexts.size()];
+	}
+
+	asio::io_context& At(size_t i) { return *this->contexts[i]; }
+
+	size_t Size() const { return this->contexts.size(); }
+
+private:
+	std::vector<std::unique_ptr<asio::io_context>> contexts;
+	std::vector<asio::executor_work_guard<asio::io_context::executor_type>> workGuards;
+	std::vector<std::thread> threads;
+
+	std::atomic<size_t> nextContext = 0;
+};
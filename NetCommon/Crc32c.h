@@ -0,0 +1,174 @@
+#pragma once
+#include "Utilities.h"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define NET_CRC32C_HARDWARE
+#include <nmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define NET_TARGET_SSE42
+#else
+#define NET_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#endif
+
+/*CRC32C (Castagnoli) checksum used to protect frames. On x86-64 CPUs with SSE4.2 it's
+computed by the crc32 instruction 8 bytes at a time, everywhere else with a lookup table.
+Both give the same result, so the two sides of a connection don't need the same CPU*/
+class Crc32c
+{
+public:
+	// Pass the result of the previous call as 'crc' to continue over more bytes
+	static uint32_t Compute(const void* data, size_t size, uint32_t crc = 0)
+	{
+#ifdef NET_CRC32C_HARDWARE
+		static const bool hasHardwareSupport = DetectHardwareSupport();
+		if (hasHardwareSupport)
+			return ComputeHardware(static_cast<const uint8_t*>(data), size, crc);
+#endif
+
+		return ComputeTable(static_cast<const uint8_t*>(data), size, crc);
+	}
+
+private:
+	static uint32_t ComputeTable(const uint8_t* data, size_t size, uint32_t crc)
+	{
+		static const std::array<uint32_t, 256> table = MakeTable();
+
+		crc = ~crc;
+		for (size_t i = 0; i < size; i++)
+			crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+		return ~crc;
+	}
+
+	static std::array<uint32_t, 256> MakeTable()
+	{
+		// Reversed Castagnoli polynomial
+		constexpr uint32_t polynomial = 0x82F63B78;
+
+		std::array<uint32_t, 256> table{};
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t value = i;
+			for (int bit = 0; bit < 8; bit++)
+				value = (value >> 1) ^ (value & 1 ? polynomial : 0);
+
+			table[i] = value;
+		}
+
+		return table;
+	}
+
+#ifdef NET_CRC32C_HARDWARE
+	// Data of at least three long blocks is split into three of them, the rest into short ones
+	static constexpr size_t longBlockSize = 8192;
+	static constexpr size_t shortBlockSize = 256;
+
+	// One table of 256 entries for every byte of the CRC
+	using ShiftTable = std::array<uint32_t, 4 * 256>;
+
+	static bool DetectHardwareSupport()
+	{
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 1);
+		return (info[2] & (1 << 20)) != 0;
+#else
+		return __builtin_cpu_supports("sse4.2");
+#endif
+	}
+
+	NET_TARGET_SSE42 static uint32_t ComputeHardware(const uint8_t* data, size_t size, uint32_t crc)
+	{
+		uint32_t raw = ~crc;
+		if (size >= 3 * shortBlockSize)
+		{
+			static const ShiftTable longShift = MakeShiftTable(longBlockSize);
+			static const ShiftTable shortShift = MakeShiftTable(shortBlockSize);
+
+			raw = ComputeStreams(data, size, raw, longBlockSize, longShift);
+			raw = ComputeStreams(data, size, raw, shortBlockSize, shortShift);
+		}
+
+		uint64_t value = raw;
+		for (; size >= 8; size -= 8, data += 8)
+			value = _mm_crc32_u64(value, Load64(data));
+
+		uint32_t value32 = uint32_t(value);
+		for (; size > 0; size--, data++)
+			value32 = _mm_crc32_u8(value32, *data);
+
+		return ~value32;
+	}
+
+	/*The crc32 instruction takes 3 cycles, but a new one can start every cycle - so three
+	independent streams over three neighbouring blocks keep it busy. The CRC of the first block
+	is then shifted over the second one and combined with its CRC, and the same again for the
+	third. Works on the raw CRC, without the inversions of Compute*/
+	NET_TARGET_SSE42 static uint32_t ComputeStreams(const uint8_t*& data, size_t& size, uint32_t raw,
+		size_t blockSize, const ShiftTable& shift)
+	{
+		for (; size >= 3 * blockSize; size -= 3 * blockSize, data += 3 * blockSize)
+		{
+			uint64_t crc0 = raw;
+			uint64_t crc1 = 0;
+			uint64_t crc2 = 0;
+			for (size_t i = 0; i < blockSize; i += 8)
+			{
+				crc0 = _mm_crc32_u64(crc0, Load64(data + i));
+				crc1 = _mm_crc32_u64(crc1, Load64(data + blockSize + i));
+				crc2 = _mm_crc32_u64(crc2, Load64(data + 2 * blockSize + i));
+			}
+
+			raw = Shift(shift, Shift(shift, uint32_t(crc0)) ^ uint32_t(crc1)) ^ uint32_t(crc2);
+		}
+
+		return raw;
+	}
+
+	/*Table which gives a raw CRC as if 'size' zero bytes were added to its data. That's a linear
+	function of the CRC, so it's computed for every single bit, and every table entry is the
+	combination of the bits it has set*/
+	static ShiftTable MakeShiftTable(size_t size)
+	{
+		const std::array<uint32_t, 256> table = MakeTable();
+
+		std::array<uint32_t, 32> shiftedBits;
+		for (size_t bit = 0; bit < 32; bit++)
+		{
+			uint32_t value = 1u << bit;
+			for (size_t i = 0; i < size; i++)
+				value = table[value & 0xFF] ^ (value >> 8);
+
+			shiftedBits[bit] = value;
+		}
+
+		ShiftTable shift{};
+		for (size_t i = 0; i < shift.size(); i++)
+		{
+			size_t byteIndex = i / 256;
+			for (size_t bit = 0; bit < 8; bit++)
+			{
+				if (i & (size_t(1) << bit))
+					shift[i] ^= shiftedBits[byteIndex * 8 + bit];
+			}
+		}
+
+		return shift;
+	}
+
+	static uint32_t Shift(const ShiftTable& shift, uint32_t raw)
+	{
+		return shift[raw & 0xFF] ^ shift[256 + ((raw >> 8) & 0xFF)] ^
+			shift[512 + ((raw >> 16) & 0xFF)] ^ shift[768 + (raw >> 24)];
+	}
+
+	static uint64_t Load64(const uint8_t* data)
+	{
+		uint64_t value;
+		std::memcpy(&value, data, 8);
+		return value;
+	}
+#endif
+};
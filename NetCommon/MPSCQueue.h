@@ -0,0 +1,165 @@
+#pragma once
+#include "Utilities.h"
+
+/*Lock-free queue for many producers and a single consumer. Producers (the I/O threads)
+never block each other - pushing is one atomic exchange and one store. Only the thread
+that consumes the queue may call the methods which look at or remove items.
+It offers the same push and drain methods as TSQueue, so it can replace it as the
+queue of incoming messages*/
+template<typename T>
+class MPSCQueue
+{
+public:
+	MPSCQueue() : head(new Node), tail(head.load()) {}
+	MPSCQueue(const MPSCQueue<T>&) = delete;
+
+	virtual ~MPSCQueue()
+	{
+		this->Clear();
+		delete this->tail;
+	}
+
+	void PushBack(const T& item)
+	{
+		this->Push(new Node{ item });
+	}
+
+	void PushBack(T&& item)
+	{
+		this->Push(new Node{ std::move(item) });
+	}
+
+	// Consumer only
+	bool IsEmpty() const
+	{
+		return this->tail->next.load(std::memory_order_acquire) == nullptr;
+	}
+
+	// Consumer only, the queue must not be empty
+	const T& Front() const
+	{
+		return *this->tail->next.load(std::memory_order_acquire)->item;
+	}
+
+	// Consumer only, the queue must not be empty
+	T PopFront()
+	{
+		T item;
+		this->TryPop(item);
+		return item;
+	}
+
+	// Consumer only
+	void Clear()
+	{
+		T item;
+		while (this->TryPop(item)) {}
+	}
+
+	// Consumer only. Moves up to 'max' items to the back of 'container'
+	template<typename Container>
+	size_t DrainTo(Container& container, size_t max = -1)
+	{
+		size_t count = 0;
+		T item;
+		while (count < max && this->TryPop(item))
+		{
+			container.push_back(std::move(item));
+			count++;
+		}
+
+		return count;
+	}
+
+	// Consumer only. Blocks the calling thread until there is at least one item in the queue
+	void Wait()
+	{
+		if (!this->IsEmpty())
+			return;
+
+		std::unique_lock lock(this->sleepMutex);
+		this->AnnounceSleep(true);
+		this->condition.wait(lock, [this]() { return !this->IsEmpty(); });
+		this->AnnounceSleep(false);
+	}
+
+	// Same as Wait, but gives up after 'timeout'. Returns true if the queue has items
+	template<typename Rep, typename Period>
+	bool WaitFor(const std::chrono::duration<Rep, Period>& timeout)
+	{
+		if (!this->IsEmpty())
+			return true;
+
+		std::unique_lock lock(this->sleepMutex);
+		this->AnnounceSleep(true);
+		bool hasItems = this->condition.wait_for(lock, timeout, [this]() { return !this->IsEmpty(); });
+		this->AnnounceSleep(false);
+		return hasItems;
+	}
+
+	/*Hook called after every push, on the pushing thread (for asio that is one of the
+	I/O threads). It must be set before the queue starts being used*/
+	void SetNotifyHook(std::function<void()> hook)
+	{
+		this->notifyHook = std::move(hook);
+	}
+
+private:
+	struct Node
+	{
+		std::optional<T> item;
+		std::atomic<Node*> next = nullptr;
+	};
+
+	void Push(Node* node)
+	{
+		/*Claiming the head is the only point where producers meet. Until the previous head
+		is linked to the new node the consumer simply doesn't see it yet*/
+		Node* previous = this->head.exchange(node, std::memory_order_acq_rel);
+		previous->next.store(node, std::memory_order_release);
+
+		/*The consumer announces that it's going to sleep before checking the queue one last
+		time, and we check the announcement after linking the node. With both sides fenced
+		at least one of them sees the other, so a wake up can't get lost*/
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (this->isConsumerSleeping.load(std::memory_order_relaxed))
+		{
+			std::scoped_lock lock(this->sleepMutex);
+			this->condition.notify_one();
+		}
+
+		if (this->notifyHook)
+			this->notifyHook();
+	}
+
+	bool TryPop(T& item)
+	{
+		// The tail is always a node whose item was already taken, its successor is the front
+		Node* front = this->tail->next.load(std::memory_order_acquire);
+		if (!front)
+			return false;
+
+		item = std::move(*front->item);
+		front->item.reset();
+
+		delete this->tail;
+		this->tail = front;
+		return true;
+	}
+
+	void AnnounceSleep(bool isSleeping)
+	{
+		this->isConsumerSleeping.store(isSleeping, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+
+	// Producers only touch the head, the consumer only touches the tail
+	alignas(64) std::atomic<Node*> head;
+	alignas(64) Node* tail;
+
+	std::atomic<bool> isConsumerSleeping = false;
+	std::mutex sleepMutex;
+	std::condition_variable condition;
+
+	std::function<void()> notifyHook;
+};
@@ -0,0 +1,141 @@
+#pragma once
+#include "Utilities.h"
+
+/*Counts the bytes held by something (a connection, a whole server) against a limit.
+Budgets can be chained - whatever is acquired from a budget is acquired from its parent too,
+so every connection can have its own budget while all of them share the server's one.
+It's safe to use from any number of threads*/
+class MemoryBudget
+{
+public:
+	static constexpr size_t unlimited = std::numeric_limits<size_t>::max();
+
+	explicit MemoryBudget(size_t limit = unlimited)
+		: limit(limit)
+	{}
+
+	MemoryBudget(const MemoryBudget&) = delete;
+
+	~MemoryBudget()
+	{
+		// Whatever is still held goes away together with its owner
+		if (this->parent)
+			this->parent->Release(this->used.load());
+	}
+
+	size_t Used() const { return this->used.load(); }
+	size_t Limit() const { return this->limit.load(); }
+
+	void SetLimit(size_t limit)
+	{
+		this->limit = limit;
+	}
+
+	// Whatever this budget already holds is moved over to the new parent
+	void SetParent(MemoryBudget* parent)
+	{
+		size_t held = this->used.load();
+		if (this->parent)
+			this->parent->Release(held);
+
+		this->parent = parent;
+		if (this->parent)
+			this->parent->Acquire(held);
+	}
+
+	// Fails without acquiring anything if this budget or any of its parents would go over the limit
+	bool TryAcquire(size_t bytes)
+	{
+		if (this->used.fetch_add(bytes) + bytes > this->limit)
+		{
+			this->used.fetch_sub(bytes);
+			return false;
+		}
+
+		if (this->parent && !this->parent->TryAcquire(bytes))
+		{
+			this->used.fetch_sub(bytes);
+			return false;
+		}
+
+		return true;
+	}
+
+	// For memory which is already taken, it may go over the limit
+	void Acquire(size_t bytes)
+	{
+		this->used.fetch_add(bytes);
+		if (this->parent)
+			this->parent->Acquire(bytes);
+	}
+
+	void Release(size_t bytes)
+	{
+		this->used.fetch_sub(bytes);
+		if (this->parent)
+			this->parent->Release(bytes);
+
+		if (this->hasWaiters.load())
+			this->NotifyWaiters();
+	}
+
+	// True if 'bytes' more would fit into every budget of the chain once the others release all they hold
+	bool CouldFit(size_t bytes) const
+	{
+		size_t held = this->used.load();
+		for (const MemoryBudget* budget = this; budget; budget = budget->parent)
+		{
+			if (held + bytes > budget->limit.load())
+				return false;
+		}
+
+		return true;
+	}
+
+	/*'waiter' is called once, on the releasing thread, the next time anything is released from
+	one of the parents - which others share, so it's them who free it. It should be cheap, like
+	posting a task*/
+	void WaitForParentRelease(const std::function<void()>& waiter)
+	{
+		for (MemoryBudget* budget = this->parent; budget; budget = budget->parent)
+		{
+			std::scoped_lock lock(budget->waitersMutex);
+			budget->waiters.push_back(waiter);
+			budget->hasWaiters = true;
+		}
+	}
+
+	// True when this budget or any of its parents is at its limit
+	bool IsExhausted() const
+	{
+		for (const MemoryBudget* budget = this; budget; budget = budget->parent)
+		{
+			if (budget->used.load() >= budget->limit.load())
+				return true;
+		}
+
+		return false;
+	}
+
+private:
+	void NotifyWaiters()
+	{
+		std::vector<std::function<void()>> notified;
+		{
+			std::scoped_lock lock(this->waitersMutex);
+			notified.swap(this->waiters);
+			this->hasWaiters = false;
+		}
+
+		for (auto& waiter : notified)
+			waiter();
+	}
+
+	std::atomic<size_t> used = 0;
+	std::atomic<size_t> limit;
+	MemoryBudget* parent = nullptr;
+
+	std::vector<std::function<void()>> waiters;
+	std::atomic<bool> hasWaiters = false;
+	std::mutex waitersMutex;
+};
@@ -1,5 +1,9 @@
 #pragma once
 #include "Utilities.h"
+#include "BufferPool.h"
+#include "MessageBody.h"
+#include "Serializer.h"
+#include "Crc32c.h"
 
 /*Message header is sent at the start of all messages. Template allows us to use 'enum class'
 to ensure that messages are valid at compile time*/
@@ -14,7 +18,10 @@ template<typename T>
 struct Message
 {
 	MessageHeader<T> header{};
-	std::vector<uint8_t> body;
+
+	/*Small bodies are stored inside the message itself, bigger ones come from the pool and
+	are given back to it when the message is destroyed*/
+	MessageBody body;
 
 	size_t size() const { return sizeof(MessageHeader<T>) + body.size(); }
 
@@ -24,30 +31,45 @@ struct Message
 		return os;
 	}
 
-	template<typename Type>
-	friend Message<T>& operator<<(Message<T>& message, const Type& data)
+	// Makes room for 'size' more bytes of body up front, so the following writes don't reallocate
+	void Reserve(size_t size)
 	{
-		// Checking if the data is trivially copyable
-		static_assert(std::is_standard_layout<Type>::value, "Data is too complex!!");
+		this->body.reserve(this->body.size() + size);
+	}
+
+	/*Appends all the values at once. Their total size is computed first (at compile time for
+	plain data, containers add their length), so the body grows only once and every value
+	is copied straight to its place. Strings and containers are sent with a length prefix
+	and can be read back with MessageReader*/
+	template<typename... Types>
+	Message<T>& Write(const Types&... data)
+	{
+		size_t dataSize = (Serializer<Types>::Size(data) + ... + 0);
 
 		// Data will be inserted from this point
-		size_t currentBodySize = message.body.size();
+		size_t currentBodySize = this->body.size();
+		this->body.resize(currentBodySize + dataSize);
 
-		// Vector is resized by the size of data being pushed
-		message.body.resize(message.body.size() + sizeof(Type));
+		// Physically copy the data into the newly allocated space, one value after another
+		uint8_t* destination = this->body.data() + currentBodySize;
+		((destination = Serializer<Types>::Write(destination, data)), ...);
 
-		// Physically copy the data into the newly allocated vector
-		std::memcpy(message.body.data() + currentBodySize, &data, sizeof(Type));
+		// Header describes only the body, that's what the receiving side reads after it
+		this->header.size = uint32_t(this->body.size());
+		return *this;
+	}
 
-		message.header.size = message.size();
-		return message;
+	template<typename Type>
+	friend Message<T>& operator<<(Message<T>& message, const Type& data)
+	{
+		return message.Write(data);
 	}
 
 	template<typename Type>
 	friend Message<T>& operator>>(Message<T>& message, Type& data)
 	{
 		// Checking if the data is trivially copyable
-		static_assert(std::is_standard_layout<Type>::value, "Data is too complex!!");
+		static_assert(std::is_trivially_copyable<Type>::value, "Data is too complex!! Read it with MessageReader");
 
 		// Cache the location towards the end of the vector where the pulled data starts
 		size_t i = message.body.size() - sizeof(data);
@@ -56,11 +78,93 @@ struct Message
 		std::memcpy(&data, message.body.data() + i, sizeof(Type));
 
 		message.body.resize(i);
-		message.header.size = message.size();
+		message.header.size = uint32_t(message.body.size());
 		return message;
 	}
 };
 
+/*Message which wasn't copied out of the receive buffer - a header and a pointer to the body
+bytes which still sit in that buffer. It's only valid while the handler it was given to runs*/
+template<typename T>
+struct MessageView
+{
+	MessageHeader<T> header{};
+	const uint8_t* body = nullptr;
+
+	size_t size() const { return sizeof(MessageHeader<T>) + header.size; }
+};
+
+/*Immutable, reference counted form of a message. Header and body are serialized only once,
+into a single contiguous block, and every copy of this object just shares that block. It's
+meant for messages which go to many connections, since queueing it doesn't copy the body
+and its checksum is computed only once*/
+template<typename T>
+class SharedMessage
+{
+public:
+	SharedMessage() = default;
+
+	/*'frameFlags' mark messages which are more than a plain message (see FrameFlags), they
+	are kept in the top 4 bits of the size in the header just like in the raw wire format*/
+	explicit SharedMessage(const Message<T>& msg, uint8_t frameFlags = 0) : size(msg.size()), flags(frameFlags)
+	{
+		/*One allocation from the pool holds the reference count, the cached checksum in the
+		first word and the serialized message after it*/
+		size_t numOfWords = 1 + (this->size + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+		this->block = std::allocate_shared_for_overwrite<uint64_t[]>(PoolAllocator<uint64_t>(), numOfWords);
+		this->block[0] = 0;
+
+		// Size on the wire always matches the body, whatever was done to the header before
+		MessageHeader<T> header = msg.header;
+		header.size = uint32_t(msg.body.size()) | uint32_t(frameFlags) << 28;
+		uint8_t* data = reinterpret_cast<uint8_t*>(this->block.get() + 1);
+		std::memcpy(data, &header, sizeof(MessageHeader<T>));
+		if (!msg.body.empty())
+			std::memcpy(data + sizeof(MessageHeader<T>), msg.body.data(), msg.body.size());
+	}
+
+	MessageHeader<T> Header() const
+	{
+		MessageHeader<T> header;
+		std::memcpy(&header, this->Data(), sizeof(MessageHeader<T>));
+		header.size = uint32_t(this->BodySize());
+		return header;
+	}
+
+	uint8_t Flags() const { return this->flags; }
+
+	// Header and body, exactly as they are sent
+	const uint8_t* Data() const { return reinterpret_cast<const uint8_t*>(this->block.get() + 1); }
+	size_t Size() const { return this->size; }
+
+	const uint8_t* Body() const { return this->Data() + sizeof(MessageHeader<T>); }
+	size_t BodySize() const { return this->size - sizeof(MessageHeader<T>); }
+
+	/*CRC-32C of Data(). The first connection which needs it computes it, every other one
+	sending the same block reuses it. Two of them may both compute it at once, which is
+	harmless since they store the same value*/
+	uint32_t Checksum() const
+	{
+		std::atomic_ref<uint64_t> cached(this->block[0]);
+		uint64_t value = cached.load(std::memory_order_relaxed);
+		if (value & checksumComputed)
+			return uint32_t(value);
+
+		uint32_t checksum = Crc32c::Compute(this->Data(), this->size);
+		cached.store(checksumComputed | checksum, std::memory_order_relaxed);
+		return checksum;
+	}
+
+	explicit operator bool() const { return this->block != nullptr; }
+
+private:
+	static constexpr uint64_t checksumComputed = uint64_t(1) << 32;
+
+	std::shared_ptr<uint64_t[]> block;
+	size_t size = 0;
+	uint8_t flags = 0;
+};
+
 template<typename T>
 class Connection;
 
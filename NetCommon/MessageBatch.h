@@ -0,0 +1,73 @@
+#pragma once
+#include "Utilities.h"
+#include "Message.h"
+#include "WireFormat.h"
+
+/*Packs many small messages into one envelope, which is sent as a single frame. Every message
+inside keeps only a compact header (varint id and size, usually 2 bytes), and the remote side
+gets them as separate messages again. Good for ticks which send dozens of tiny updates.
+The envelope is a shared message, so one can be broadcast to any number of clients*/
+template<typename T>
+class MessageBatch
+{
+public:
+	void Add(const Message<T>& msg)
+	{
+		size_t offset = this->envelope.body.size();
+		this->envelope.body.resize(offset + FrameCodec<T>::maxHeaderSize + msg.body.size());
+
+		uint8_t* entry = this->envelope.body.data() + offset;
+		size_t headerSize = FrameCodec<T>::EncodeHeader({ msg.header.id, uint32_t(msg.body.size()) }, EntryOptions(), entry);
+		if (!msg.body.empty())
+			std::memcpy(entry + headerSize, msg.body.data(), msg.body.size());
+
+		this->envelope.body.resize(offset + headerSize + msg.body.size());
+		this->count++;
+	}
+
+	size_t Count() const { return this->count; }
+	size_t Size() const { return this->envelope.body.size(); }
+	bool IsEmpty() const { return this->count == 0; }
+
+	// Keeps the memory for the next batch
+	void Clear()
+	{
+		this->envelope.body.clear();
+		this->count = 0;
+	}
+
+	SharedMessage<T> Build() const
+	{
+		return SharedMessage<T>(this->envelope, FrameFlags::ENVELOPE);
+	}
+
+	/*Reads the message at 'offset' in the body of an envelope and moves 'offset' past it.
+	Returns false if the envelope isn't valid there*/
+	static bool ReadEntry(const uint8_t* data, size_t size, size_t& offset, MessageHeader<T>& header, const uint8_t*& body)
+	{
+		FrameHeader<T> entry;
+		size_t headerSize = 0;
+		if (!FrameCodec<T>::DecodeHeader(data + offset, size - offset, EntryOptions(), entry, headerSize))
+			return false;
+
+		// A message cut in half or with flags can't be in an envelope
+		if (headerSize == 0 || entry.flags != FrameFlags::NONE || entry.size > size - offset - headerSize)
+			return false;
+
+		header = { entry.id, entry.size };
+		body = data + offset + headerSize;
+		offset += headerSize + entry.size;
+		return true;
+	}
+
+private:
+	static WireOptions EntryOptions()
+	{
+		WireOptions options;
+		options.compactHeaders = true;
+		return options;
+	}
+
+	Message<T> envelope;
+	size_t count = 0;
+};
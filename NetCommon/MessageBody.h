@@ -0,0 +1,133 @@
+#pragma once
+#include "Utilities.h"
+#include "BufferPool.h"
+
+/*Byte buffer used for message bodies. Payloads up to 'inlineCapacity' bytes are stored inside
+the object itself, so small messages (pings, IDs, small structs) don't allocate anything.
+Only when a body grows past that it moves to a block from BufferPool. It offers the part of
+the std::vector interface which messages need, but bytes added by resize are left
+uninitialized, since they are always overwritten right away*/
+class MessageBody
+{
+public:
+	static constexpr size_t inlineCapacity = 64;
+
+	MessageBody() = default;
+
+	MessageBody(const MessageBody& other)
+	{
+		this->assign(other.begin(), other.end());
+	}
+
+	MessageBody(MessageBody&& other) noexcept
+	{
+		this->Steal(other);
+	}
+
+	~MessageBody()
+	{
+		this->Release();
+	}
+
+	MessageBody& operator=(const MessageBody& other)
+	{
+		if (this != &other)
+			this->assign(other.begin(), other.end());
+
+		return *this;
+	}
+
+	MessageBody& operator=(MessageBody&& other) noexcept
+	{
+		if (this != &other)
+		{
+			this->Release();
+			this->Steal(other);
+		}
+
+		return *this;
+	}
+
+	uint8_t* data() { return this->heap ? this->heap : this->local; }
+	const uint8_t* data() const { return this->heap ? this->heap : this->local; }
+
+	uint8_t* begin() { return this->data(); }
+	uint8_t* end() { return this->data() + this->length; }
+	const uint8_t* begin() const { return this->data(); }
+	const uint8_t* end() const { return this->data() + this->length; }
+
+	uint8_t& operator[](size_t i) { return this->data()[i]; }
+	const uint8_t& operator[](size_t i) const { return this->data()[i]; }
+
+	size_t size() const { return this->length; }
+	size_t capacity() const { return this->heapCapacity ? this->heapCapacity : inlineCapacity; }
+	bool empty() const { return this->length == 0; }
+
+	void reserve(size_t newCapacity)
+	{
+		if (newCapacity <= this->capacity())
+			return;
+
+		uint8_t* newHeap = static_cast<uint8_t*>(BufferPool::Allocate(newCapacity));
+		if (this->length > 0)
+			std::memcpy(newHeap, this->data(), this->length);
+
+		if (this->heap)
+			BufferPool::Deallocate(this->heap, this->heapCapacity);
+
+		this->heap = newHeap;
+		this->heapCapacity = newCapacity;
+	}
+
+	void resize(size_t newSize)
+	{
+		// Grows at least twice, so bodies built piece by piece don't reallocate every time
+		if (newSize > this->capacity())
+			this->reserve(std::max(newSize, this->capacity() * 2));
+
+		this->length = newSize;
+	}
+
+	void clear() { this->length = 0; }
+
+	void assign(const uint8_t* first, const uint8_t* last)
+	{
+		size_t newSize = last - first;
+		this->length = 0;
+		this->resize(newSize);
+		if (newSize > 0)
+			std::memcpy(this->data(), first, newSize);
+	}
+
+private:
+	void Steal(MessageBody& other)
+	{
+		this->length = other.length;
+		if (other.heap)
+		{
+			this->heap = other.heap;
+			this->heapCapacity = other.heapCapacity;
+			other.heap = nullptr;
+			other.heapCapacity = 0;
+		}
+		else if (other.length > 0)
+			std::memcpy(this->local, other.local, other.length);
+
+		other.length = 0;
+	}
+
+	void Release()
+	{
+		if (this->heap)
+			BufferPool::Deallocate(this->heap, this->heapCapacity);
+
+		this->heap = nullptr;
+		this->heapCapacity = 0;
+		this->length = 0;
+	}
+
+	uint8_t* heap = nullptr;
+	size_t heapCapacity = 0;
+	size_t length = 0;
+	alignas(8) uint8_t local[inlineCapacity];
+};
@@ -0,0 +1,80 @@
+#pragma once
+#include "Utilities.h"
+#include "Message.h"
+
+/*Reads the body of a message front to back, in the same order the values were written.
+Unlike operator>> on the message it never modifies the message, so a received message can
+be read by several handlers (or threads) at once without copying it. Reading past the end
+of the body throws std::out_of_range*/
+class MessageReader
+{
+public:
+	MessageReader(const uint8_t* data, size_t size) : current(data), end(data + size) {}
+
+	template<typename T>
+	explicit MessageReader(const Message<T>& msg) : MessageReader(msg.body.data(), msg.body.size()) {}
+
+	template<typename T>
+	explicit MessageReader(const MessageView<T>& msg) : MessageReader(msg.body, msg.header.size) {}
+
+	/*Reads the values in the order they were written. Plain data is read with a single bounds
+	check for all of it, strings and containers go through their Serializer*/
+	template<typename... Types>
+	MessageReader& Read(Types&... data)
+	{
+		if constexpr ((std::is_trivially_copyable_v<Types> && ...))
+		{
+			constexpr size_t dataSize = (sizeof(Types) + ... + 0);
+			this->Require(dataSize);
+
+			((std::memcpy(&data, this->current, sizeof(Types)), this->current += sizeof(Types)), ...);
+		}
+		else
+			(Serializer<Types>::Read(*this, data), ...);
+
+		return *this;
+	}
+
+	template<typename Type>
+	Type Read()
+	{
+		Type data;
+		this->Read(data);
+		return data;
+	}
+
+	template<typename Type>
+	MessageReader& operator>>(Type& data)
+	{
+		return this->Read(data);
+	}
+
+	void ReadBytes(void* destination, size_t size)
+	{
+		this->Require(size);
+		std::memcpy(destination, this->current, size);
+		this->current += size;
+	}
+
+	void Skip(size_t size)
+	{
+		this->Require(size);
+		this->current += size;
+	}
+
+	// Points to the bytes which haven't been read yet
+	const uint8_t* Current() const { return this->current; }
+	size_t Remaining() const { return this->end - this->current; }
+	bool IsDone() const { return this->current == this->end; }
+
+	void Require(size_t size) const
+	{
+		if (this->Remaining() < size)
+			throw std::out_of_range("Message body is shorter than the data being read");
+	}
+
+private:
+
+	const uint8_t* current;
+	const uint8_t* end;
+};
@@ -0,0 +1,61 @@
+#pragma once
+#include "Utilities.h"
+#include "Message.h"
+#include "MessageReader.h"
+
+/*A schema describes one kind of message in a single place - which id it's sent with and
+which fields it carries, in which order:
+
+	struct PingMessage
+	{
+		static constexpr CustomMsgType id = CustomMsgType::SERVER_PING;
+		std::chrono::system_clock::time_point timeSent;
+		uint32_t sequence = 0;
+
+		auto Fields() { return std::tie(timeSent, sequence); }
+		auto Fields() const { return std::tie(timeSent, sequence); }
+	};
+
+Encode and Decode are both generated from that one field list, so the two sides can't read
+the fields in a different order than they were written*/
+template<typename Schema>
+concept MessageSchema = requires(Schema schema, const Schema constSchema)
+{
+	Schema::id;
+	schema.Fields();
+	constSchema.Fields();
+};
+
+template<MessageSchema Schema>
+using SchemaMessageType = std::remove_const_t<decltype(Schema::id)>;
+
+template<MessageSchema Schema>
+Message<SchemaMessageType<Schema>> Encode(const Schema& schema)
+{
+	Message<SchemaMessageType<Schema>> msg;
+	msg.header.id = Schema::id;
+
+	// All the fields go in with a single Write, so the body is allocated only once
+	std::apply([&msg](const auto&... fields) { msg.Write(fields...); }, schema.Fields());
+	return msg;
+}
+
+// Works for both Message and MessageView, throws std::out_of_range if the body is too short
+template<MessageSchema Schema, typename Msg>
+Schema Decode(const Msg& msg)
+{
+	Schema schema;
+	MessageReader reader(msg);
+	std::apply([&reader](auto&... fields) { reader.Read(fields...); }, schema.Fields());
+	return schema;
+}
+
+/*Decodes the message as the schema with the matching id and calls the handler with it, so an
+overloaded handler (or a generic lambda) gets the typed message picked at compile time. The
+comparisons against each schema's id are generated from the list, nobody has to maintain a
+switch over the ids. Returns false if none of the schemas matches*/
+template<MessageSchema... Schemas, typename Msg, typename Handler>
+bool Dispatch(const Msg& msg, Handler&& handler)
+{
+	return ((msg.header.id == Schemas::id && (handler(Decode<Schemas>(msg)), true)) || ...);
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include "Utilities.h"
+
+/*Fixed size ring buffer for exactly one producer thread and one consumer thread. Neither
+side ever waits for the other - a push or a pop is a couple of loads and one store. The
+capacity is rounded up to a power of two, so wrapping the indices is a simple mask.
+When the ring is full, TryPush fails and leaves the decision what to do to the caller*/
+template<typename T>
+class SPSCRing
+{
+public:
+	explicit SPSCRing(size_t capacity)
+	{
+		size_t size = 1;
+		while (size < capacity)
+			size <<= 1;
+
+		this->slots = std::make_unique<T[]>(size);
+		this->mask = size - 1;
+	}
+
+	SPSCRing(const SPSCRing<T>&) = delete;
+
+	// Producer only
+	bool TryPush(const T& item)
+	{
+		T copy = item;
+		return this->TryPush(std::move(copy));
+	}
+
+	// Producer only
+	bool TryPush(T&& item)
+	{
+		size_t write = this->writeIndex.load(std::memory_order_relaxed);
+		if (write - this->cachedReadIndex > this->mask)
+		{
+			// Looks full, but the consumer might have moved on since we last checked
+			this->cachedReadIndex = this->readIndex.load(std::memory_order_acquire);
+			if (write - this->cachedReadIndex > this->mask)
+				return false;
+		}
+
+		this->slots[write & this->mask] = std::move(item);
+		this->writeIndex.store(write + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer only. Returns nullptr if the ring is empty
+	T* Front()
+	{
+		size_t read = this->readIndex.load(std::memory_order_relaxed);
+		if (read == this->cachedWriteIndex)
+		{
+			this->cachedWriteIndex = this->writeIndex.load(std::memory_order_acquire);
+			if (read == this->cachedWriteIndex)
+				return nullptr;
+		}
+
+		return &this->slots[read & this->mask];
+	}
+
+	// Consumer only, Front must have returned an item before
+	void PopFront()
+	{
+		size_t read = this->readIndex.load(std::memory_order_relaxed);
+
+		// Releases whatever the item holds right away instead of when the slot is reused
+		this->slots[read & this->mask] = T();
+		this->readIndex.store(read + 1, std::memory_order_release);
+	}
+
+	// Exact only when called from one of the two sides while the other one is idle
+	bool IsEmpty() const
+	{
+		return this->readIndex.load(std::memory_order_acquire) == this->writeIndex.load(std::memory_order_acquire);
+	}
+
+	size_t Size() const
+	{
+		return this->writeIndex.load(std::memory_order_acquire) - this->readIndex.load(std::memory_order_acquire);
+	}
+
+	size_t Capacity() const { return this->mask + 1; }
+
+private:
+	std::unique_ptr<T[]> slots;
+	size_t mask = 0;
+
+	/*Each index lives on its own cache line together with the other side's cached copy
+	of it, so the producer and the consumer don't keep invalidating each other's cache*/
+	alignas(64) std::atomic<size_t> writeIndex = 0;
+	size_t cachedReadIndex = 0;
+
+	alignas(64) std::atomic<size_t> readIndex = 0;
+	size_t cachedWriteIndex = 0;
+};
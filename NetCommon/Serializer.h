@@ -0,0 +1,183 @@
+#pragma once
+#include "Utilities.h"
+
+template<typename Type>
+inline constexpr bool isSerializerMissing = false;
+
+/*Describes how a type is turned into body bytes and back. Trivially copyable types, strings
+and the standard containers are covered below. To make your own type sendable, specialize
+Serializer for it with these three members:
+	static size_t Size(const Type& value) - how many bytes Write will produce
+	static uint8_t* Write(uint8_t* destination, const Type& value) - returns the end of the written bytes
+	template<typename Reader> static void Read(Reader& reader, Type& value)*/
+template<typename Type, typename Enable = void>
+struct Serializer
+{
+	static_assert(isSerializerMissing<Type>, "Data is too complex!! Specialize Serializer for it");
+};
+
+// Containers send their element count first, as this type
+using LengthPrefix = uint32_t;
+
+// Keys of map elements are const, so they are read into a pair of plain types first
+template<typename Type>
+struct ReadableElement { using type = Type; };
+
+template<typename Key, typename Value>
+struct ReadableElement<std::pair<const Key, Value>> { using type = std::pair<Key, Value>; };
+
+// Plain data is copied as it is
+template<typename Type>
+struct Serializer<Type, std::enable_if_t<std::is_trivially_copyable_v<Type>>>
+{
+	static constexpr size_t Size(const Type&) { return sizeof(Type); }
+
+	static uint8_t* Write(uint8_t* destination, const Type& value)
+	{
+		std::memcpy(destination, &value, sizeof(Type));
+		return destination + sizeof(Type);
+	}
+
+	template<typename Reader>
+	static void Read(Reader& reader, Type& value)
+	{
+		reader.ReadBytes(&value, sizeof(Type));
+	}
+};
+
+/*Contiguous containers of plain data - the length and then all elements with a single
+memcpy, no matter how many of them there are*/
+template<typename Container>
+struct ContiguousSerializer
+{
+	using Element = typename Container::value_type;
+
+	static size_t Size(const Container& container)
+	{
+		return sizeof(LengthPrefix) + container.size() * sizeof(Element);
+	}
+
+	static uint8_t* Write(uint8_t* destination, const Container& container)
+	{
+		destination = Serializer<LengthPrefix>::Write(destination, LengthPrefix(container.size()));
+		size_t size = container.size() * sizeof(Element);
+		if (size > 0)
+			std::memcpy(destination, container.data(), size);
+
+		return destination + size;
+	}
+
+	template<typename Reader>
+	static void Read(Reader& reader, Container& container)
+	{
+		LengthPrefix length;
+		Serializer<LengthPrefix>::Read(reader, length);
+
+		// Checked before resizing, so a broken length can't make us allocate gigabytes
+		size_t size = size_t(length) * sizeof(Element);
+		reader.Require(size);
+
+		container.resize(length);
+		if (size > 0)
+			reader.ReadBytes(container.data(), size);
+	}
+};
+
+// Any other container - the length and then every element with its own Serializer
+template<typename Container>
+struct ElementwiseSerializer
+{
+	using Element = typename Container::value_type;
+
+	static size_t Size(const Container& container)
+	{
+		size_t size = sizeof(LengthPrefix);
+		for (const Element& element : container)
+			size += Serializer<Element>::Size(element);
+
+		return size;
+	}
+
+	static uint8_t* Write(uint8_t* destination, const Container& container)
+	{
+		destination = Serializer<LengthPrefix>::Write(destination, LengthPrefix(container.size()));
+		for (const Element& element : container)
+			destination = Serializer<Element>::Write(destination, element);
+
+		return destination;
+	}
+
+	template<typename Reader>
+	static void Read(Reader& reader, Container& container)
+	{
+		LengthPrefix length;
+		Serializer<LengthPrefix>::Read(reader, length);
+
+		// Every element takes at least one byte, anything more can't be a valid length
+		reader.Require(length);
+
+		container.clear();
+		for (LengthPrefix i = 0; i < length; i++)
+		{
+			typename ReadableElement<Element>::type element;
+			Serializer<typename ReadableElement<Element>::type>::Read(reader, element);
+			container.insert(container.end(), std::move(element));
+		}
+	}
+};
+
+template<typename Char, typename Traits, typename Allocator>
+struct Serializer<std::basic_string<Char, Traits, Allocator>>
+	: ContiguousSerializer<std::basic_string<Char, Traits, Allocator>> {};
+
+template<typename Element, typename Allocator>
+struct Serializer<std::vector<Element, Allocator>>
+	: std::conditional_t<std::is_trivially_copyable_v<Element> && !std::is_same_v<Element, bool>,
+		ContiguousSerializer<std::vector<Element, Allocator>>,
+		ElementwiseSerializer<std::vector<Element, Allocator>>> {};
+
+template<typename Element, typename Allocator>
+struct Serializer<std::deque<Element, Allocator>> : ElementwiseSerializer<std::deque<Element, Allocator>> {};
+
+template<typename Element, typename Allocator>
+struct Serializer<std::list<Element, Allocator>> : ElementwiseSerializer<std::list<Element, Allocator>> {};
+
+template<typename Key, typename Compare, typename Allocator>
+struct Serializer<std::set<Key, Compare, Allocator>> : ElementwiseSerializer<std::set<Key, Compare, Allocator>> {};
+
+template<typename Key, typename Hash, typename Equal, typename Allocator>
+struct Serializer<std::unordered_set<Key, Hash, Equal, Allocator>>
+	: ElementwiseSerializer<std::unordered_set<Key, Hash, Equal, Allocator>> {};
+
+template<typename Key, typename Value, typename Compare, typename Allocator>
+struct Serializer<std::map<Key, Value, Compare, Allocator>>
+	: ElementwiseSerializer<std::map<Key, Value, Compare, Allocator>> {};
+
+template<typename Key, typename Value, typename Hash, typename Equal, typename Allocator>
+struct Serializer<std::unordered_map<Key, Value, Hash, Equal, Allocator>>
+	: ElementwiseSerializer<std::unordered_map<Key, Value, Hash, Equal, Allocator>> {};
+
+// Pairs which hold plain data are plain data themselves, these are the ones which aren't
+template<typename First, typename Second>
+struct Serializer<std::pair<First, Second>, std::enable_if_t<!std::is_trivially_copyable_v<std::pair<First, Second>>>>
+{
+	using Pair = std::pair<First, Second>;
+
+	static size_t Size(const Pair& pair)
+	{
+		return Serializer<std::remove_const_t<First>>::Size(pair.first) + Serializer<Second>::Size(pair.second);
+	}
+
+	static uint8_t* Write(uint8_t* destination, const Pair& pair)
+	{
+		destination = Serializer<std::remove_const_t<First>>::Write(destination, pair.first);
+		return Serializer<Second>::Write(destination, pair.second);
+	}
+
+	template<typename Reader>
+	static void Read(Reader& reader, Pair& pair)
+	{
+		Serializer<First>::Read(reader, pair.first);
+		Serializer<Second>::Read(reader, pair.second);
+	}
+};
@@ -3,13 +3,31 @@
 #include "Message.h"
 #include "ThreadSafeQueue.h"
 #include "Connection.h"
+#include "ContextPool.h"
 
 template<typename T>
 class ServerInterface
 {
 public:
-	ServerInterface(uint16_t port) : acceptor(context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port))
-	{}
+	/*Socket I/O is spread over 'numOfThreads' threads. Every connection sticks to one of
+	them, so a single connection never runs on two threads at once.
+	With 'shardAcceptors' every thread opens its own acceptor on the same port (SO_REUSEPORT),
+	the kernel balances new connections between them and each connection stays on the
+	thread which accepted it. Where SO_REUSEPORT doesn't exist (Windows) one acceptor is used*/
+	ServerInterface(uint16_t port, size_t numOfThreads = std::thread::hardware_concurrency(), bool shardAcceptors = false)
+		: contexts(numOfThreads)
+	{
+		asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), port);
+
+#ifdef SO_REUSEPORT
+		size_t numOfAcceptors = shardAcceptors ? this->contexts.Size() : 1;
+#else
+		size_t numOfAcceptors = 1;
+#endif
+
+		for (size_t i = 0; i < numOfAcceptors; i++)
+			this->acceptors.push_back(OpenAcceptor(this->contexts.At(i), endpoint, numOfAcceptors > 1));
+	}
 
 	virtual ~ServerInterface()
 	{
@@ -21,7 +39,7 @@ public:
 		try
 		{
 			this->WaitForClientConnection();
-			this->contextThread = std::thread([this]() { context.run(); });
+			this->contexts.Run();
 		}
 		catch (std::exception& ex)
 		{
@@ -35,102 +53,206 @@ public:
 
 	void Stop()
 	{
-		this->context.stop();
-		this->contextThread.join();
+		this->contexts.Stop();
 		std::cout << "Server stopped!\n";
 	}
 
-	// This is asynchronous method
 	void WaitForClientConnection()
 	{
-		this->acceptor.async_accept(
-			[this](asio::error_code ec, asio::ip::tcp::socket socket)
+		for (size_t i = 0; i < this->acceptors.size(); i++)
+			this->WaitForClientConnection(i);
+	}
+
+	// This is asynchronous method
+	void WaitForClientConnection(size_t acceptorIndex)
+	{
+		/*A sharded acceptor keeps its connections on its own context, otherwise
+		the new connection will live on the next context of the pool*/
+		bool isSharded = this->acceptors.size() > 1;
+		asio::io_context& connectionContext = isSharded ? this->contexts.At(acceptorIndex) : this->contexts.Next();
+
+		this->acceptors[acceptorIndex]->async_accept(connectionContext,
+			[this, acceptorIndex, &connectionContext](asio::error_code ec, asio::ip::tcp::socket socket)
 			{
 				if (ec)
 				{
 					std::cout << "Server connection error: " << ec.message() << '\n';
-					WaitForClientConnection();
+					WaitForClientConnection(acceptorIndex);
 					return;
 				}
 
 				std::cout << "Server accepted new connection: " << socket.remote_endpoint() << '\n';
 				std::shared_ptr<Connection<T>> conn = std::make_shared<Connection<T>>(
-					Connection<T>::Owner::SERVER, context, std::move(socket), messagesIn
+					Connection<T>::Owner::SERVER, connectionContext, std::move(socket), messagesIn
+				);
+
+				// Everything is set up before OnClientConnected, which may already send to the client
+				if (useMessageViews)
+				{
+					conn->SetViewHandler([this](std::shared_ptr<Connection<T>> client, const MessageView<T>& msg)
+						{
+							OnMessageView(client, msg);
+						}
+					);
+				}
+
+				{
+					std::scoped_lock lock(connectionsMutex);
+					conn->SetAllowedWireOptions(allowedWireOptions);
+					conn->SetMemoryLimits(maxMessageSize, connectionMemoryLimit, &memoryBudget);
+					conn->SetBackpressure(backpressureOptions,
+						[this](std::shared_ptr<Connection<T>> client) { OnBackpressure(client); },
+						[this](std::shared_ptr<Connection<T>> client) { OnDrained(client); }
+					);
+					conn->SetWriteDeadlines(writeTimeout, minBytesPerSecond, rateWindow);
+				}
+
+				conn->SetCloseHandler([this](std::shared_ptr<Connection<T>> client, DisconnectReason reason)
+					{
+						// The remote side going away or the server disconnecting it isn't an eviction
+						if (reason != DisconnectReason::LOCAL && reason != DisconnectReason::REMOTE &&
+							reason != DisconnectReason::WRITE_FAILED)
+							OnClientEvicted(client, reason);
+					}
 				);
 
 				if (!OnClientConnected(conn))
 				{
 					std::cout << "Connection denied!\n";
-					WaitForClientConnection();
+					WaitForClientConnection(acceptorIndex);
 					return;
 				}
 
-				connections.push_back(std::move(conn));
-				auto& newlyAddedConnection = connections.back();
-				newlyAddedConnection->ConnectToClient(IDCounter++);
-				std::cout << '[' << newlyAddedConnection->ID() << "] Connection approved!\n";
-				WaitForClientConnection();
+				conn->ConnectToClient(IDCounter++);
+				std::cout << '[' << conn->ID() << "] Connection approved!\n";
+
+				{
+					std::scoped_lock lock(connectionsMutex);
+					connections.push_back(std::move(conn));
+				}
+
+				WaitForClientConnection(acceptorIndex);
 			}
 		);
 	}
 
-	void MessageClient(std::shared_ptr<Connection<T>> client, const Message<T>& msg)
+	/*In message view mode OnMessageView is called instead of OnMessage. It runs right on the
+	I/O thread which received the message, and the message isn't copied anywhere - which suits
+	fire and forget handlers. Only affects connections accepted after the call*/
+	void SetMessageViewMode(bool enabled)
 	{
-		if (client && client->IsConnected())
-		{
-			client->SendMsg(msg);
-			return;
-		}
+		this->useMessageViews = enabled;
+	}
 
-		auto end = this->connections.end();
+	// Wire options which clients can ask for, only affects connections accepted after the call
+	void SetAllowedWireOptions(const WireOptions& options)
+	{
+		std::scoped_lock lock(this->connectionsMutex);
+		this->allowedWireOptions = options;
+	}
 
-		OnClientDisconnected(client);
-		client.reset();
-		this->connections.erase(std::remove(this->connections.begin(), end, client), end);
+	/*Protects the server from clients which send too much. Messages over 'maxMessageSize' drop
+	the client. A client whose received but not yet handled messages (plus the receive buffer
+	past its default size) reach 'connectionLimit' isn't read from until Update catches up,
+	the same happens to everyone once all clients together reach 'totalLimit'. The limits
+	per client only affect connections accepted after the call*/
+	void SetMemoryLimits(uint32_t maxMessageSize, size_t connectionLimit, size_t totalLimit = MemoryBudget::unlimited)
+	{
+		std::scoped_lock lock(this->connectionsMutex);
+		this->maxMessageSize = maxMessageSize;
+		this->connectionMemoryLimit = connectionLimit;
+		this->memoryBudget.SetLimit(totalLimit);
 	}
 
-	void MessageAllClients(const Message<T>& msg, std::shared_ptr<Connection<T>> ignoredClient = nullptr)
+	/*Watermarks of every client's outgoing queue and what happens to messages sent to a client
+	which is over the high one. Only affects connections accepted after the call.
+	BLOCK makes MessageAllClients wait for the slowest client - use it only where that's
+	acceptable. Sends from the I/O threads (OnClientConnected, OnMessageView, OnDrained...)
+	never wait, they queue the message over the high watermark instead*/
+	void SetBackpressure(const BackpressureOptions& options)
 	{
-		bool invalidClientExists = false;
-		for (auto& client : connections)
-		{
-			if (client && client->IsConnected())
-			{
-				if (client != ignoredClient)
-					client->SendMsg(msg);
+		std::scoped_lock lock(this->connectionsMutex);
+		this->backpressureOptions = options;
+	}
 
-				continue;
-			}
+	/*Evicts clients which don't keep up with what is sent to them, see Connection::SetWriteDeadlines.
+	They are reported through OnClientEvicted as soon as they are closed. Only affects connections
+	accepted after the call*/
+	void SetWriteDeadlines(std::chrono::milliseconds writeTimeout, size_t minBytesPerSecond = 0,
+		std::chrono::milliseconds rateWindow = std::chrono::seconds(10))
+	{
+		std::scoped_lock lock(this->connectionsMutex);
+		this->writeTimeout = writeTimeout;
+		this->minBytesPerSecond = minBytesPerSecond;
+		this->rateWindow = rateWindow;
+	}
 
-			this->OnClientDisconnected(client);
-			client.reset();
-			invalidClientExists = true;
-		}
+	// Returns false if the message wasn't queued - the client is gone, or its backpressure policy dropped it
+	bool MessageClient(std::shared_ptr<Connection<T>> client, const Message<T>& msg)
+	{
+		if (client && client->IsConnected())
+			return client->SendMsg(msg);
 
-		if (!invalidClientExists)
-			return;
+		OnClientDisconnected(client);
 
+		std::scoped_lock lock(this->connectionsMutex);
 		auto end = this->connections.end();
-		this->connections.erase(std::remove(this->connections.begin(), end, nullptr), end);
+		this->connections.erase(std::remove(this->connections.begin(), end, client), end);
+		return false;
+	}
+
+	// Returns the number of clients the message was queued for
+	size_t MessageAllClients(const Message<T>& msg, std::shared_ptr<Connection<T>> ignoredClient = nullptr)
+	{
+		// Message is serialized only once and every client's queue shares that copy
+		return this->MessageAllClients(SharedMessage<T>(msg), ignoredClient);
+	}
+
+	size_t MessageAllClients(const SharedMessage<T>& msg, std::shared_ptr<Connection<T>> ignoredClient = nullptr)
+	{
+		return this->Broadcast(msg, std::nullopt, ignoredClient);
+	}
+
+	/*Latest value wins for every client - a message with the same key which is still waiting
+	to be sent to a client is replaced by this one (see Connection::SendMsg)*/
+	size_t MessageAllClients(const Message<T>& msg, uint64_t coalesceKey, std::shared_ptr<Connection<T>> ignoredClient = nullptr)
+	{
+		return this->Broadcast(SharedMessage<T>(msg), coalesceKey, ignoredClient);
 	}
 
-	void Update(size_t numOfMaxMessages = -1)
+	size_t MessageAllClients(const SharedMessage<T>& msg, uint64_t coalesceKey, std::shared_ptr<Connection<T>> ignoredClient = nullptr)
 	{
-		size_t numOfMessages = 0;
-		while (numOfMessages < numOfMaxMessages && !messagesIn.IsEmpty())
+		return this->Broadcast(msg, coalesceKey, ignoredClient);
+	}
+
+	/*With 'wait' set, the calling thread sleeps until at least one message arrives instead
+	of returning straight away, so an idle server doesn't burn a core calling Update*/
+	void Update(size_t numOfMaxMessages = -1, bool wait = false)
+	{
+		if (wait)
+			this->messagesIn.Wait();
+
+		/*All pending messages are moved out under a single lock acquisition and then
+		handled one by one without touching the queue again*/
+		this->messagesIn.DrainTo(this->updateBatch, numOfMaxMessages);
+		for (auto& msg : this->updateBatch)
 		{
-			// Grab the front message
-			auto msg = messagesIn.Front();
+			// The handler may change the message, so remember its size first
+			size_t bodySize = msg.msg.body.size();
 
 			// Pass to message handler
 			OnMessage(msg.remoteConnection, msg.msg);
 
-			numOfMessages++;
+			// Now the connection can count on this memory again
+			msg.remoteConnection->ReleaseReceived(bodySize);
 		}
+
+		this->updateBatch.clear();
 	}
 
 protected:
-	// Here you can reject the certain connection by returning false
+	/*Here you can reject the certain connection by returning false. With sharded acceptors
+	this can be called from several threads at once*/
 	virtual bool OnClientConnected(std::shared_ptr<Connection<T>> client)
 	{
 		return false;
@@ -141,21 +263,137 @@ protected:
 		
 	}
 
+	/*Called on the client's I/O thread right after the server closed the connection because of
+	the client - it sent something invalid or too much, or didn't keep up with what is sent to
+	it. OnClientDisconnected still follows once the client is tidied up*/
+	virtual void OnClientEvicted(std::shared_ptr<Connection<T>> client, DisconnectReason reason)
+	{
+
+	}
+
+	/*Called on the sending thread when the client's outgoing queue reaches the high watermark,
+	the client isn't keeping up with what is sent to it. No lock of the server is held, so it
+	can send to clients*/
+	virtual void OnBackpressure(std::shared_ptr<Connection<T>> client)
+	{
+
+	}
+
+	/*Called on the client's I/O thread once its outgoing queue is back down to the low
+	watermark*/
+	virtual void OnDrained(std::shared_ptr<Connection<T>> client)
+	{
+
+	}
+
 	// Called when a message arrives
 	virtual void OnMessage(std::shared_ptr<Connection<T>> client, Message<T>& msg)
 	{
 
 	}
 
-	TSQueue<OwnedMessage<T>> messagesIn;
-	asio::io_context context;
-	std::thread contextThread;
+	/*Called when a message arrives in message view mode. It can run on several I/O threads at
+	once, and the view is valid only until this returns. Sending from here is fine, SendMsg
+	and MessageClient can be called from any thread - with BackpressurePolicy::BLOCK they
+	don't wait here though, since the I/O thread would wait for itself*/
+	virtual void OnMessageView(std::shared_ptr<Connection<T>> client, const MessageView<T>& msg)
+	{
 
-	// This object will be used to get sockets of connected clients
-	asio::ip::tcp::acceptor acceptor;
+	}
+
+private:
+	size_t Broadcast(const SharedMessage<T>& msg, std::optional<uint64_t> coalesceKey, const std::shared_ptr<Connection<T>>& ignoredClient)
+	{
+		/*The clients are only picked under the lock, sending happens after it's released - with
+		BackpressurePolicy::BLOCK a send can wait for a slow client, and accepting new clients
+		on the I/O threads mustn't wait with it*/
+		std::vector<std::shared_ptr<Connection<T>>> clients;
+		std::vector<std::shared_ptr<Connection<T>>> disconnectedClients;
+		{
+			std::scoped_lock lock(this->connectionsMutex);
+			clients.reserve(this->connections.size());
+
+			for (auto& client : connections)
+			{
+				if (client && client->IsConnected())
+				{
+					if (client != ignoredClient)
+						clients.push_back(client);
+
+					continue;
+				}
 
+				disconnectedClients.push_back(std::move(client));
+			}
+
+			if (!disconnectedClients.empty())
+			{
+				auto end = this->connections.end();
+				this->connections.erase(std::remove(this->connections.begin(), end, nullptr), end);
+			}
+		}
+
+		// User code runs without the lock too, so it can send or broadcast from the hooks
+		for (auto& client : disconnectedClients)
+			this->OnClientDisconnected(client);
+
+		size_t numOfQueued = 0;
+		for (auto& client : clients)
+		{
+			bool isQueued = coalesceKey ? client->SendMsg(msg, *coalesceKey) : client->SendMsg(msg);
+			numOfQueued += isQueued;
+		}
+
+		return numOfQueued;
+	}
+
+	static std::unique_ptr<asio::ip::tcp::acceptor> OpenAcceptor(asio::io_context& context,
+		const asio::ip::tcp::endpoint& endpoint, bool reusePort)
+	{
+		auto acceptor = std::make_unique<asio::ip::tcp::acceptor>(context);
+		acceptor->open(endpoint.protocol());
+		acceptor->set_option(asio::ip::tcp::acceptor::reuse_address(true));
+
+#ifdef SO_REUSEPORT
+		// Lets every acceptor bind the same port, asio has no portable option for it
+		if (reusePort)
+			acceptor->set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#endif
+
+		acceptor->bind(endpoint);
+		acceptor->listen();
+		return acceptor;
+	}
+
+protected:
+	// Memory of all connections together, declared first since they release into it when destroyed
+	MemoryBudget memoryBudget;
+	uint32_t maxMessageSize = FrameCodec<T>::maxBodySize;
+	size_t connectionMemoryLimit = MemoryBudget::unlimited;
+
+	BackpressureOptions backpressureOptions;
+
+	std::chrono::milliseconds writeTimeout{ 0 };
+	size_t minBytesPerSecond = 0;
+	std::chrono::milliseconds rateWindow = std::chrono::seconds(10);
+
+	IncomingQueue<T> messagesIn;
+	ContextPool contexts;
+
+	// These objects will be used to get sockets of connected clients, one per thread when sharded
+	std::vector<std::unique_ptr<asio::ip::tcp::acceptor>> acceptors;
+
+	/*Connections are added from the thread accepting them and used from the thread
+	sending messages, so access to them must be guarded*/
 	std::deque<std::shared_ptr<Connection<T>>> connections;
+	std::mutex connectionsMutex;
+
+	std::atomic<bool> useMessageViews = false;
+	WireOptions allowedWireOptions = WireOptions::All();
+
+	// Messages taken from 'messagesIn' by Update, kept as a member so its memory is reused
+	std::vector<OwnedMessage<T>> updateBatch;
 
 	// This is necessary because every client will be represented by numeric ID
-	uint32_t IDCounter = 10000;
+	std::atomic<uint32_t> IDCounter = 10000;
 };
\ No newline at end of file
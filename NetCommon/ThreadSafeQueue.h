@@ -23,14 +23,42 @@ public:
 
 	void PushFront(const T& item)
 	{
-		std::scoped_lock lock(this->mutex);
-		this->deque.emplace_front(std::move(item));
+		{
+			std::scoped_lock lock(this->mutex);
+			this->deque.emplace_front(item);
+		}
+
+		this->Notify();
+	}
+
+	void PushFront(T&& item)
+	{
+		{
+			std::scoped_lock lock(this->mutex);
+			this->deque.emplace_front(std::move(item));
+		}
+
+		this->Notify();
 	}
 
 	void PushBack(const T& item)
 	{
-		std::scoped_lock lock(this->mutex);
-		this->deque.emplace_back(std::move(item));
+		{
+			std::scoped_lock lock(this->mutex);
+			this->deque.emplace_back(item);
+		}
+
+		this->Notify();
+	}
+
+	void PushBack(T&& item)
+	{
+		{
+			std::scoped_lock lock(this->mutex);
+			this->deque.emplace_back(std::move(item));
+		}
+
+		this->Notify();
 	}
 
 	bool IsEmpty()
@@ -51,6 +79,50 @@ public:
 		this->deque.clear();
 	}
 
+	/*Moves up to 'max' items from the front of the queue to the back of 'container' while
+	holding the lock only once, so the caller can work through them without locking again*/
+	template<typename Container>
+	size_t DrainTo(Container& container, size_t max = -1)
+	{
+		std::scoped_lock lock(this->mutex);
+		size_t count = std::min(max, this->deque.size());
+		auto end = this->deque.begin() + count;
+
+		std::move(this->deque.begin(), end, std::back_inserter(container));
+		this->deque.erase(this->deque.begin(), end);
+		return count;
+	}
+
+	// Exchanges the whole content of the queue with 'other' in constant time
+	void Swap(std::deque<T>& other)
+	{
+		std::scoped_lock lock(this->mutex);
+		this->deque.swap(other);
+	}
+
+	// Blocks the calling thread until there is at least one item in the queue
+	void Wait()
+	{
+		std::unique_lock lock(this->mutex);
+		this->condition.wait(lock, [this]() { return !this->deque.empty(); });
+	}
+
+	// Same as Wait, but gives up after 'timeout'. Returns true if the queue has items
+	template<typename Rep, typename Period>
+	bool WaitFor(const std::chrono::duration<Rep, Period>& timeout)
+	{
+		std::unique_lock lock(this->mutex);
+		return this->condition.wait_for(lock, timeout, [this]() { return !this->deque.empty(); });
+	}
+
+	/*Hook called after every push, on the pushing thread (for asio that is one of the
+	I/O threads). It should be set before the queue starts being used*/
+	void SetNotifyHook(std::function<void()> hook)
+	{
+		std::scoped_lock lock(this->mutex);
+		this->notifyHook = std::move(hook);
+	}
+
 	T PopFront()
 	{
 		std::scoped_lock lock(this->mutex);
@@ -68,6 +140,18 @@ public:
 	}
 
 protected:
+	void Notify()
+	{
+		// Notifying outside of the lock saves the woken thread from blocking on it right away
+		this->condition.notify_one();
+
+		if (this->notifyHook)
+			this->notifyHook();
+	}
+
 	std::mutex mutex;
+	std::condition_variable condition;
 	std::deque<T> deque;
+
+	std::function<void()> notifyHook;
 };
\ No newline at end of file
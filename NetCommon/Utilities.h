@@ -4,12 +4,28 @@
 #include <thread>
 #include <optional>
 #include <mutex>
+#include <condition_variable>
+#include <functional>
 #include <deque>
 #include <vector>
+#include <list>
+#include <set>
+#include <map>
+#include <unordered_set>
+#include <unordered_map>
+#include <string>
+#include <array>
 #include <iostream>
 #include <chrono>
 #include <algorithm>
+#include <iterator>
 #include <cstdint>
+#include <type_traits>
+#include <cstring>
+#include <tuple>
+#include <stdexcept>
+#include <atomic>
+#include <limits>
 
 #ifdef _WIN64
 #define _WIN64_WINNT 0x0601
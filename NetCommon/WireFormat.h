@@ -0,0 +1,264 @@
+#pragma once
+#include "Utilities.h"
+#include "Message.h"
+#include "Crc32c.h"
+
+/*Options which both sides of a connection agree on right after it's established. Until
+then (and with peers which never ask for anything) the raw format is used*/
+struct WireOptions
+{
+	/*Id and size are sent as LEB128 varints instead of the raw MessageHeader struct, which
+	makes most headers 2 bytes long, independent of endianness and padding*/
+	bool compactHeaders = false;
+
+	/*Every frame is followed by a CRC32C of its header and body, and a frame which doesn't
+	match it drops the connection. TCP's own checksum misses some corruptions (and anything
+	that happens inside proxies), this catches them before they reach the application*/
+	bool checksums = false;
+
+	/*Large messages may be split into fragments, so they don't stop everything else on the
+	connection while they're being sent. Such a message can then arrive after messages which
+	were sent later than it. See Connection::SetFragmentSize*/
+	bool fragmentation = false;
+
+	/*Envelopes (see MessageBatch) are sent as they are. Otherwise the messages inside them
+	are sent one by one*/
+	bool envelopes = false;
+
+	static WireOptions All()
+	{
+		WireOptions options;
+		options.compactHeaders = true;
+		options.checksums = true;
+		options.fragmentation = true;
+		options.envelopes = true;
+		return options;
+	}
+
+	// Only what both sides support can be used
+	WireOptions Intersect(const WireOptions& other) const
+	{
+		WireOptions options;
+		options.compactHeaders = this->compactHeaders && other.compactHeaders;
+		options.checksums = this->checksums && other.checksums;
+		options.fragmentation = this->fragmentation && other.fragmentation;
+		options.envelopes = this->envelopes && other.envelopes;
+		return options;
+	}
+
+	uint8_t ToBits() const
+	{
+		return (this->compactHeaders ? 1 : 0) | (this->checksums ? 2 : 0) | (this->fragmentation ? 4 : 0) | (this->envelopes ? 8 : 0);
+	}
+
+	static WireOptions FromBits(uint8_t bits)
+	{
+		WireOptions options;
+		options.compactHeaders = bits & 1;
+		options.checksums = bits & 2;
+		options.fragmentation = bits & 4;
+		options.envelopes = bits & 8;
+		return options;
+	}
+
+	bool operator==(const WireOptions&) const = default;
+};
+
+// Frames which don't carry a plain message are marked by these flags
+struct FrameFlags
+{
+	static constexpr uint8_t NONE = 0;
+
+	// Used by the connections themselves, never given to the application
+	static constexpr uint8_t CONTROL = 1 << 0;
+
+	// Part of a message, the parts are sent in order and the last one is also marked LAST_FRAGMENT
+	static constexpr uint8_t FRAGMENT = 1 << 1;
+	static constexpr uint8_t LAST_FRAGMENT = 1 << 2;
+
+	// Body holds many messages, each with a compact header (see MessageBatch)
+	static constexpr uint8_t ENVELOPE = 1 << 3;
+};
+
+// First byte of the body of every CONTROL frame
+enum class ControlType : uint8_t
+{
+	NEGOTIATE_REQUEST, // Client asks for wire options
+	NEGOTIATE_ACCEPT, // Server answers which of them it accepted, it sends them from now on
+	NEGOTIATE_CONFIRM // Client sends everything after this with the accepted options too
+};
+
+// Header of a frame as it's sent, without being tied to one encoding
+template<typename T>
+struct FrameHeader
+{
+	T id{};
+	uint32_t size = 0;
+	uint8_t flags = FrameFlags::NONE;
+};
+
+/*Turns frame headers into bytes and back.
+Raw format is the MessageHeader struct as it is, with the frame flags kept in the top
+4 bits of the size - which limits a single frame to 256 MB.
+Compact format is varint(id), then varint(size << 1 | hasFlags), then a flags byte only if
+there are any flags.
+With checksums on, the 4 byte little endian CRC32C of the encoded header and the body
+follows the body*/
+template<typename T>
+class FrameCodec
+{
+public:
+	static constexpr uint32_t maxBodySize = (1u << 28) - 1;
+
+	// 10 bytes for any 64 bit id, 5 for the size, 1 for the flags
+	static constexpr size_t maxHeaderSize = std::max<size_t>(sizeof(MessageHeader<T>), 16);
+
+	static constexpr size_t checksumSize = sizeof(uint32_t);
+
+	// Bytes which follow the body of every frame
+	static size_t TrailerSize(const WireOptions& options)
+	{
+		return options.checksums ? checksumSize : 0;
+	}
+
+	static void EncodeChecksum(uint32_t checksum, uint8_t* destination)
+	{
+		for (size_t i = 0; i < checksumSize; i++)
+			destination[i] = uint8_t(checksum >> (8 * i));
+	}
+
+	static uint32_t DecodeChecksum(const uint8_t* data)
+	{
+		uint32_t checksum = 0;
+		for (size_t i = 0; i < checksumSize; i++)
+			checksum |= uint32_t(data[i]) << (8 * i);
+
+		return checksum;
+	}
+
+	// Writes the header to 'destination' and returns how many bytes it took
+	static size_t EncodeHeader(const FrameHeader<T>& header, const WireOptions& options, uint8_t* destination)
+	{
+		if (!options.compactHeaders)
+		{
+			MessageHeader<T> raw;
+			raw.id = header.id;
+			raw.size = header.size | uint32_t(header.flags) << 28;
+			std::memcpy(destination, &raw, sizeof(MessageHeader<T>));
+			return sizeof(MessageHeader<T>);
+		}
+
+		uint8_t* current = destination;
+		current = EncodeVarint(IdToInteger(header.id), current);
+		current = EncodeVarint(uint64_t(header.size) << 1 | (header.flags ? 1 : 0), current);
+		if (header.flags)
+			*current++ = header.flags;
+
+		return current - destination;
+	}
+
+	/*Reads a header from the start of 'data'. 'headerSize' is set to 0 when more bytes are
+	needed to decode it. Returns false if the bytes can't be a valid header*/
+	static bool DecodeHeader(const uint8_t* data, size_t available, const WireOptions& options,
+		FrameHeader<T>& header, size_t& headerSize)
+	{
+		headerSize = 0;
+		if (!options.compactHeaders)
+		{
+			if (available < sizeof(MessageHeader<T>))
+				return true;
+
+			MessageHeader<T> raw;
+			std::memcpy(&raw, data, sizeof(MessageHeader<T>));
+			header.id = raw.id;
+			header.size = raw.size & maxBodySize;
+			header.flags = uint8_t(raw.size >> 28);
+			headerSize = sizeof(MessageHeader<T>);
+			return true;
+		}
+
+		const uint8_t* current = data;
+		const uint8_t* end = data + available;
+
+		uint64_t id = 0;
+		uint64_t sizeAndFlag = 0;
+		for (uint64_t* value : { &id, &sizeAndFlag })
+		{
+			VarintResult result = DecodeVarint(current, end, *value);
+			if (result != VarintResult::COMPLETE)
+				return result == VarintResult::INCOMPLETE;
+		}
+
+		header.id = IntegerToId(id);
+		header.size = uint32_t(sizeAndFlag >> 1);
+		header.flags = FrameFlags::NONE;
+		if (sizeAndFlag & 1)
+		{
+			if (current == end)
+				return true;
+
+			header.flags = *current++;
+		}
+
+		if ((sizeAndFlag >> 1) > maxBodySize)
+			return false;
+
+		headerSize = current - data;
+		return true;
+	}
+
+private:
+	static uint64_t IdToInteger(T id)
+	{
+		if constexpr (std::is_enum_v<T>)
+			return uint64_t(std::underlying_type_t<T>(id));
+		else
+			return uint64_t(id);
+	}
+
+	static T IntegerToId(uint64_t value)
+	{
+		if constexpr (std::is_enum_v<T>)
+			return T(std::underlying_type_t<T>(value));
+		else
+			return T(value);
+	}
+
+	static uint8_t* EncodeVarint(uint64_t value, uint8_t* destination)
+	{
+		// 7 bits per byte, lowest ones first, the top bit says that more bytes follow
+		while (value >= 0x80)
+		{
+			*destination++ = uint8_t(value) | 0x80;
+			value >>= 7;
+		}
+
+		*destination++ = uint8_t(value);
+		return destination;
+	}
+
+	enum class VarintResult
+	{
+		COMPLETE,
+		INCOMPLETE,
+		MALFORMED
+	};
+
+	static VarintResult DecodeVarint(const uint8_t*& current, const uint8_t* end, uint64_t& value)
+	{
+		value = 0;
+		for (int shift = 0; shift < 64; shift += 7)
+		{
+			if (current == end)
+				return VarintResult::INCOMPLETE;
+
+			uint8_t byte = *current++;
+			value |= uint64_t(byte & 0x7F) << shift;
+			if (!(byte & 0x80))
+				return VarintResult::COMPLETE;
+		}
+
+		// Longer than any 64 bit value can be
+		return VarintResult::MALFORMED;
+	}
+};
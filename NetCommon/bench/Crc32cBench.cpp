@@ -0,0 +1,171 @@
+/*Measures how fast frame checksums are computed, for frame sizes from a small message to a
+large fragment. Crc32c::Compute is compared with a plain single stream crc32 loop, which shows
+what interleaving the streams gains, and with memcpy of the same bytes as a yardstick for
+what touching the data costs anyway. Then 1 KB frames are sent through a loopback socket the
+way the raw format writes and reads them, with and without checksums, which shows what they
+cost a connection as a whole. Not part of any project, build it on its own with
+optimizations, e.g.
+	g++ -std=c++20 -O2 -pthread -I.. -I<asio>/include Crc32cBench.cpp*/
+#include "WireFormat.h"
+#include <iomanip>
+
+enum class BenchMsg : uint32_t { DATA };
+
+#ifdef NET_CRC32C_HARDWARE
+NET_TARGET_SSE42 static uint32_t ComputeSingleStream(const uint8_t* data, size_t size)
+{
+	uint64_t value = 0xFFFFFFFF;
+	for (; size >= 8; size -= 8, data += 8)
+	{
+		uint64_t chunk;
+		std::memcpy(&chunk, data, 8);
+		value = _mm_crc32_u64(value, chunk);
+	}
+
+	uint32_t value32 = uint32_t(value);
+	for (; size > 0; size--, data++)
+		value32 = _mm_crc32_u8(value32, *data);
+
+	return ~value32;
+}
+#endif
+
+// Returns GB per second of running 'function' over buffers of 'size' bytes
+template<typename Function>
+double Measure(size_t size, Function&& function)
+{
+	// Roughly the same amount of bytes for every size, and enough to get past the clock's resolution
+	size_t numOfRuns = std::max<size_t>(1, (size_t(1) << 30) / size);
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < numOfRuns; i++)
+		function();
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return double(size) * numOfRuns / elapsed.count() / 1e9;
+}
+
+/*Returns frames per second of sending 'numOfFrames' frames with 'bodySize' bytes long bodies
+through a loopback socket. With 'checksums' set the sender appends one to every frame and the
+receiver checks it, otherwise it's the same bytes minus the trailer*/
+double MeasureFrames(size_t bodySize, bool checksums, size_t numOfFrames)
+{
+	// As many frames as WriteMessages gathers into one batch of buffers
+	constexpr size_t framesPerBatch = 64;
+	numOfFrames -= numOfFrames % framesPerBatch;
+
+	asio::io_context context;
+	asio::ip::tcp::acceptor acceptor(context, { asio::ip::tcp::v4(), 0 });
+	asio::ip::tcp::socket sender(context);
+	asio::ip::tcp::socket receiver(context);
+	sender.connect({ asio::ip::address_v4::loopback(), acceptor.local_endpoint().port() });
+	acceptor.accept(receiver);
+
+	Message<BenchMsg> msg;
+	msg.body.resize(bodySize);
+	for (size_t i = 0; i < bodySize; i++)
+		msg.body[i] = uint8_t(i * 131 + 7);
+
+	size_t trailerSize = checksums ? FrameCodec<BenchMsg>::checksumSize : 0;
+	size_t frameSize = msg.size() + trailerSize;
+	bool isIntact = true;
+
+	auto start = std::chrono::steady_clock::now();
+
+	std::thread reader([&]()
+		{
+			std::vector<uint8_t> batch(frameSize * framesPerBatch);
+			for (size_t received = 0; received < numOfFrames; received += framesPerBatch)
+			{
+				asio::read(receiver, asio::buffer(batch));
+				if (!checksums)
+					continue;
+
+				for (const uint8_t* frame = batch.data(); frame < batch.data() + batch.size(); frame += frameSize)
+				{
+					uint32_t checksum = FrameCodec<BenchMsg>::DecodeChecksum(frame + msg.size());
+					isIntact = isIntact && Crc32c::Compute(frame, msg.size()) == checksum;
+				}
+			}
+		}
+	);
+
+	/*Every frame is its own message, so each one is serialized and has its checksum computed
+	like a message sent to a single connection*/
+	std::vector<SharedMessage<BenchMsg>> messages;
+	std::vector<uint8_t> trailers(FrameCodec<BenchMsg>::checksumSize * framesPerBatch);
+	std::vector<asio::const_buffer> buffers;
+	for (size_t sent = 0; sent < numOfFrames; sent += framesPerBatch)
+	{
+		messages.clear();
+		buffers.clear();
+		for (size_t i = 0; i < framesPerBatch; i++)
+		{
+			const SharedMessage<BenchMsg>& frame = messages.emplace_back(msg);
+			buffers.push_back(asio::buffer(frame.Data(), frame.Size()));
+			if (checksums)
+			{
+				uint8_t* trailer = trailers.data() + i * trailerSize;
+				FrameCodec<BenchMsg>::EncodeChecksum(frame.Checksum(), trailer);
+				buffers.push_back(asio::buffer(trailer, trailerSize));
+			}
+		}
+
+		asio::write(sender, buffers);
+	}
+
+	reader.join();
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return isIntact ? numOfFrames / elapsed.count() : 0;
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<uint8_t> data(1 << 20);
+	std::vector<uint8_t> copy(data.size());
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = uint8_t(i * 131 + 7);
+
+	// Keeps the compiler from throwing away results which are never used
+	volatile uint32_t sink = 0;
+
+	std::cout << "     size     Compute  one stream      memcpy (GB/s)\n";
+	for (size_t size : { 64, 512, 1024, 4096, 65536, 1 << 20 })
+	{
+		double compute = Measure(size, [&]() { sink = sink + Crc32c::Compute(data.data(), size); });
+
+		double singleStream = 0;
+#ifdef NET_CRC32C_HARDWARE
+		singleStream = Measure(size, [&]() { sink = sink + ComputeSingleStream(data.data(), size); });
+#endif
+
+		double memoryCopy = Measure(size, [&]()
+			{
+				std::memcpy(copy.data(), data.data(), size);
+				sink = sink + copy[size - 1];
+			}
+		);
+
+		std::cout << std::setw(9) << size << std::fixed << std::setprecision(2) << std::setw(12) << compute
+			<< std::setw(12) << singleStream << std::setw(12) << memoryCopy << '\n';
+	}
+
+	size_t numOfFrames = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1'000'000;
+	size_t bodySize = 1024;
+
+	// Alternate a few times, so neither side is favoured by whatever else the machine is doing
+	double plain = 0, checked = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		plain = std::max(plain, MeasureFrames(bodySize, false, numOfFrames));
+		checked = std::max(checked, MeasureFrames(bodySize, true, numOfFrames));
+	}
+
+	std::cout << "\n1 KB frames over loopback (thousand frames/s)\n"
+		<< "      plain   checksums    overhead\n" << std::fixed << std::setprecision(1)
+		<< std::setw(11) << plain / 1e3 << std::setw(12) << checked / 1e3
+		<< std::setw(11) << (plain / checked - 1) * 100 << "%\n";
+
+	return 0;
+}
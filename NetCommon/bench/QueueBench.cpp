@@ -0,0 +1,73 @@
+/*Compares TSQueue with MPSCQueue as the queue of incoming messages - several producers (the
+I/O threads) push into it while one consumer (the thread calling Update) drains it in
+batches. Not part of any project, build it on its own with optimizations, e.g.
+	g++ -std=c++20 -O2 -pthread -I.. -I<asio>/include QueueBench.cpp
+The optional argument is the number of items pushed by all producers together*/
+#include "ThreadSafeQueue.h"
+#include "MPSCQueue.h"
+#include <iomanip>
+
+// Returns items per second, or 0 if the consumer saw a producer's items out of order
+template<typename Queue>
+double Run(size_t numOfProducers, size_t numOfItems)
+{
+	Queue queue;
+	size_t itemsPerProducer = numOfItems / numOfProducers;
+	size_t total = itemsPerProducer * numOfProducers;
+
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> producers;
+	for (size_t p = 0; p < numOfProducers; p++)
+	{
+		producers.emplace_back([&queue, itemsPerProducer, p]()
+			{
+				for (size_t i = 0; i < itemsPerProducer; i++)
+					queue.PushBack(uint64_t(p) << 32 | i);
+			}
+		);
+	}
+
+	// Every producer's items have to arrive in the order they were pushed
+	std::vector<uint64_t> batch;
+	std::vector<int64_t> lastItems(numOfProducers, -1);
+	bool isOrdered = true;
+	for (size_t received = 0; received < total;)
+	{
+		queue.WaitFor(std::chrono::milliseconds(1));
+		received += queue.DrainTo(batch);
+
+		for (uint64_t item : batch)
+		{
+			size_t producer = item >> 32;
+			int64_t index = item & 0xFFFFFFFF;
+			isOrdered = isOrdered && index == lastItems[producer] + 1;
+			lastItems[producer] = index;
+		}
+
+		batch.clear();
+	}
+
+	for (auto& producer : producers)
+		producer.join();
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return isOrdered ? total / elapsed.count() : 0;
+}
+
+int main(int argc, char** argv)
+{
+	size_t numOfItems = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 4'000'000;
+
+	std::cout << "producers     TSQueue   MPSCQueue (million items/s)\n";
+	for (size_t numOfProducers : { 1, 4, 16, 64 })
+	{
+		double locked = Run<TSQueue<uint64_t>>(numOfProducers, numOfItems) / 1e6;
+		double lockFree = Run<MPSCQueue<uint64_t>>(numOfProducers, numOfItems) / 1e6;
+
+		std::cout << std::setw(9) << numOfProducers << std::fixed << std::setprecision(2)
+			<< std::setw(12) << locked << std::setw(12) << lockFree << '\n';
+	}
+
+	return 0;
+}
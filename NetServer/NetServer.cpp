@@ -43,7 +43,7 @@ int main()
 
     while (true)
     {
-        server.Update();
+        server.Update(-1, true);
     }
 
     